@@ -0,0 +1,338 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2026 Dmitry Adzhiev <dmitry.adjiev@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include "memory.h"
+
+/*
+ * Allocator benchmarks. Run with no arguments for the default heap size or
+ * pass the heap size in MiB. Hardware counters are not read here, run the
+ * binary under `perf stat -e dTLB-load-misses` to see TLB effects directly.
+ */
+
+static constexpr size_t kMiB = 1024 * 1024;
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_ns(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+static void report(const char *workload, const char *config, double value, const char *unit)
+{
+    printf("%-24s %-24s %14.2f %s\n", workload, config, value, unit);
+}
+
+// ----------------------------------------------------------------------
+// Heap setup
+// ----------------------------------------------------------------------
+
+/* Heap on regular pages, transparent huge pages are explicitly disabled */
+static void *map_small_page_heap(size_t size)
+{
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+
+#if defined(MADV_NOHUGEPAGE)
+    madvise(base, size, MADV_NOHUGEPAGE);
+#endif
+    mem_initialize(base, size, MEM_INIT_ZEROED);
+    return base;
+}
+
+// ----------------------------------------------------------------------
+// Pointer chasing over randomly linked small objects
+// ----------------------------------------------------------------------
+
+struct ChaseNode
+{
+    ChaseNode *next;
+    uint64_t payload[7];
+};
+
+static double bench_pointer_chase(size_t heap_size)
+{
+    size_t count = heap_size / (sizeof(ChaseNode) * 2);
+    std::vector<ChaseNode *> nodes;
+    nodes.reserve(count);
+
+    for (size_t i = 0; i < count; ++i) {
+        auto node = static_cast<ChaseNode *>(mem_malloc(sizeof(ChaseNode)));
+
+        if (!node) {
+            break;
+        }
+
+        nodes.push_back(node);
+    }
+
+    std::mt19937_64 rng(1);
+    std::shuffle(nodes.begin(), nodes.end(), rng);
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        nodes[i]->next = nodes[(i + 1) % nodes.size()];
+    }
+
+    const size_t steps = 20 * 1000 * 1000;
+    ChaseNode *cursor = nodes.front();
+    auto start = Clock::now();
+
+    for (size_t i = 0; i < steps; ++i) {
+        cursor = cursor->next;
+    }
+
+    double ns = elapsed_ns(start) / steps;
+    asm volatile("" : : "r"(cursor));
+    /* The nodes are not freed one by one, the caller drops the whole heap */
+    return ns;
+}
+
+static void run_pointer_chase(size_t heap_size)
+{
+    void *base = map_small_page_heap(heap_size);
+
+    if (base) {
+        report("pointer_chase", "4k-pages", bench_pointer_chase(heap_size), "ns/step");
+        mem_unuinitialize();
+        munmap(base, heap_size);
+    }
+
+    if (mem_heap_map(heap_size) == 0) {
+        const char *config = mem_heap_huge_page_size() ? "huge-pages" : "huge-pages(unavailable)";
+        report("pointer_chase", config, bench_pointer_chase(heap_size), "ns/step");
+        mem_heap_close();
+    }
+}
+
+// ----------------------------------------------------------------------
+// Working set survival across large clears and copies
+// ----------------------------------------------------------------------
+
+/*
+ * Touches a small working set, then zeroes and copies a large block through
+ * mem_calloc() and mem_realloc(), and measures how long it takes to walk the
+ * working set again. Streaming stores should leave it in the cache.
+ */
+static double bench_working_set(size_t block_size)
+{
+    const size_t working_set_size = 256 * 1024;
+    const int rounds = 16;
+    std::vector<uint64_t> working_set(working_set_size / sizeof(uint64_t), 1);
+    double total = 0;
+    uint64_t sum = 0;
+
+    for (int round = 0; round < rounds; ++round) {
+        /* Make the whole block dirty so that mem_calloc() has to clear it */
+        void *dirty = mem_malloc(block_size);
+
+        if (!dirty) {
+            return 0;
+        }
+
+        memset(dirty, 0xFF, block_size);
+        mem_free(dirty);
+
+        for (auto value: working_set) {
+            sum += value;
+        }
+
+        void *block = mem_calloc(block_size, 1);
+        void *moved = block ? mem_realloc(block, block_size + 4096) : nullptr;
+
+        auto start = Clock::now();
+
+        for (auto value: working_set) {
+            sum += value;
+        }
+
+        total += elapsed_ns(start);
+        mem_free(moved ? moved : block);
+    }
+
+    asm volatile("" : : "r"(sum));
+    return total / rounds / 1000;
+}
+
+static void run_working_set(size_t heap_size)
+{
+    size_t block_size = heap_size / 4;
+    void *base = map_small_page_heap(heap_size);
+
+    if (!base) {
+        return;
+    }
+
+    mem_set_stream_threshold(0);
+    report("working_set_rewalk", "cached-stores", bench_working_set(block_size), "us");
+    mem_set_stream_threshold(1024 * 1024);
+    report("working_set_rewalk", "streaming-stores", bench_working_set(block_size), "us");
+    mem_unuinitialize();
+    munmap(base, heap_size);
+}
+
+// ----------------------------------------------------------------------
+// Teardown of a large structure, one free at a time against one batch
+// ----------------------------------------------------------------------
+
+/*
+ * Frees every node of a structure in random order. Merged neighbours grow
+ * past the small bins, so single frees keep walking the sorted large bin,
+ * while the batch coalesces each run once.
+ */
+static double bench_teardown(size_t count, bool batch)
+{
+    std::vector<void *> nodes;
+    nodes.reserve(count);
+    std::mt19937_64 rng(2);
+
+    for (size_t i = 0; i < count; ++i) {
+        void *node = mem_malloc(64 + rng() % 512);
+
+        if (!node) {
+            break;
+        }
+
+        nodes.push_back(node);
+    }
+
+    /* Every fifth node survives, so the heap keeps many separate free ranges */
+    std::vector<void *> doomed;
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (i % 5 != 0) {
+            doomed.push_back(nodes[i]);
+        }
+    }
+
+    std::shuffle(doomed.begin(), doomed.end(), rng);
+    auto start = Clock::now();
+
+    if (batch) {
+        mem_free_batch(doomed.data(), doomed.size());
+    }
+    else {
+        for (void *node: doomed) {
+            mem_free(node);
+        }
+    }
+
+    double ms = elapsed_ns(start) / 1e6;
+    std::vector<void *> survivors;
+
+    for (size_t i = 0; i < nodes.size(); i += 5) {
+        survivors.push_back(nodes[i]);
+    }
+
+    mem_free_batch(survivors.data(), survivors.size());
+    return ms;
+}
+
+static void run_teardown(size_t heap_size)
+{
+    void *base = map_small_page_heap(heap_size);
+
+    if (!base) {
+        return;
+    }
+
+    /* Single frees are quadratic here, a larger structure only makes the run longer */
+    const size_t count = std::min<size_t>(heap_size / 1024, 30000);
+    report("teardown", "mem_free", bench_teardown(count, false), "ms");
+    report("teardown", "mem_free_batch", bench_teardown(count, true), "ms");
+    mem_unuinitialize();
+    munmap(base, heap_size);
+}
+
+// ----------------------------------------------------------------------
+// Growing buffers next to unrelated small allocations
+// ----------------------------------------------------------------------
+
+/*
+ * Builds a log by appending lines with mem_realloc() while every line also
+ * allocates a small record, the way a log builder or a vector shared with
+ * other work grows. Returns the bytes copied by buffer moves in MiB.
+ */
+static double bench_buffer_growth(size_t final_size, bool hint)
+{
+    const size_t line = 80;
+    std::vector<void *> records;
+    char *log = static_cast<char *>(hint ? mem_malloc_hint(line, final_size) : mem_malloc(line));
+    size_t copied = 0;
+
+    for (size_t size = line; log && size + line <= final_size; size += line) {
+        auto grown = static_cast<char *>(mem_realloc(log, size + line));
+
+        if (!grown) {
+            break;
+        }
+
+        copied += grown != log ? size : 0;
+        log = grown;
+        memset(log + size, 'x', line);
+        records.push_back(mem_malloc(32));
+    }
+
+    records.push_back(log);
+    mem_free_batch(records.data(), records.size());
+    return double(copied) / kMiB;
+}
+
+static void run_buffer_growth(size_t heap_size)
+{
+    void *base = map_small_page_heap(heap_size);
+
+    if (!base) {
+        return;
+    }
+
+    size_t final_size = std::min<size_t>(heap_size / 8, 4 * kMiB);
+    report("buffer_growth", "mem_malloc", bench_buffer_growth(final_size, false), "MiB copied");
+    report("buffer_growth", "mem_malloc_hint", bench_buffer_growth(final_size, true), "MiB copied");
+    mem_unuinitialize();
+    munmap(base, heap_size);
+}
+
+int main(int argc, char **argv)
+{
+    size_t heap_size = (argc > 1 ? strtoull(argv[1], nullptr, 10) : 512) * kMiB;
+
+    printf("%-24s %-24s %14s\n", "workload", "config", "result");
+    run_pointer_chase(heap_size);
+    run_working_set(heap_size);
+    run_teardown(heap_size);
+    run_buffer_growth(heap_size);
+    return 0;
+}
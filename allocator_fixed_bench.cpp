@@ -0,0 +1,115 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2026 Dmitry Adzhiev <dmitry.adjiev@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include "fixed_alloc.h"
+
+/*
+ * Compile time sized allocations through mem_malloc() against the inline
+ * fast path of fixed_alloc.h. The same source is built as
+ * allocator_fixed_bench and, with link time optimization,
+ * allocator_fixed_bench_lto, so the two binaries show what inlining across
+ * memory.cpp adds on top of the cache.
+ */
+
+static constexpr size_t kHeapSize = 64 * 1024 * 1024;
+
+static constexpr size_t kLive = 48;
+
+static constexpr size_t kRounds = 200000;
+
+using Clock = std::chrono::steady_clock;
+
+struct Message
+{
+    uint64_t id;
+    uint32_t length;
+    char text[36];
+};
+
+/* Allocates kLive blocks of each of three sizes and frees them again, kRounds times */
+template<typename Alloc, typename Free>
+static double churn(Alloc alloc, Free free)
+{
+    void *live[3][kLive];
+    auto start = Clock::now();
+
+    for (size_t round = 0; round < kRounds; ++round) {
+        for (size_t i = 0; i < kLive; ++i) {
+            live[0][i] = alloc.template operator()<16>();
+            live[1][i] = alloc.template operator()<sizeof(Message)>();
+            live[2][i] = alloc.template operator()<200>();
+        }
+
+        for (size_t i = 0; i < kLive; ++i) {
+            free.template operator()<16>(live[0][i]);
+            free.template operator()<sizeof(Message)>(live[1][i]);
+            free.template operator()<200>(live[2][i]);
+        }
+    }
+
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    return ns / (kRounds * kLive * 3);
+}
+
+static void report(const char *workload, double value)
+{
+    printf("%-24s %14.2f ns/op\n", workload, value);
+}
+
+int main()
+{
+    std::unique_ptr<char[]> heap(new char[kHeapSize]);
+
+    if (mem_initialize(heap.get(), kHeapSize) != 0) {
+        return 1;
+    }
+
+    printf("%-24s %14s\n", "workload", "alloc+free");
+    report("mem_malloc", churn([]<size_t N>() { return mem_malloc(N); },
+                               []<size_t N>(void *ptr) { mem_free(ptr); }));
+    report("mem_malloc_fixed", churn([]<size_t N>() { return mem_malloc_fixed<N>(); },
+                                     []<size_t N>(void *ptr) { mem_free_fixed<N>(ptr); }));
+
+    const size_t count = kRounds * kLive;
+    Message *messages[kLive];
+    auto start = Clock::now();
+
+    for (size_t round = 0; round < kRounds; ++round) {
+        for (auto &message: messages) {
+            message = mem_new<Message>();
+        }
+
+        for (auto message: messages) {
+            mem_delete(message);
+        }
+    }
+
+    report("mem_new<Message>", std::chrono::duration<double, std::nano>(Clock::now() - start).count() / count);
+    mem_fixed_flush();
+    return mem_check() ? 0 : 1;
+}
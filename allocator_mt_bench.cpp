@@ -0,0 +1,428 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2026 Dmitry Adzhiev <dmitry.adjiev@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <atomic>
+#include <barrier>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "memory.h"
+
+/*
+ * Concurrent allocator benchmarks. Every workload is run for 1..N threads
+ * (powers of two and N itself, N defaults to the number of CPUs and may be
+ * given as the first argument) against glibc malloc and against this
+ * allocator. The allocator is not thread safe, so its calls are serialized
+ * with a global mutex; that row is the baseline any concurrent mode has to
+ * beat. Each run happens in a forked child so that peak RSS is per run.
+ */
+
+static constexpr size_t kMiB = 1024 * 1024;
+
+static constexpr size_t kHeapSize = 1024 * kMiB;
+
+static constexpr size_t kCacheLine = 64;
+
+using Clock = std::chrono::steady_clock;
+
+static double elapsed_s(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// ----------------------------------------------------------------------
+// Allocators under test
+// ----------------------------------------------------------------------
+
+struct BenchAllocator
+{
+    const char *name;
+    void *(*alloc)(size_t size);
+    void (*release)(void *ptr);
+    bool uses_heap;
+};
+
+static std::mutex gMemLock;
+
+static void *locked_mem_malloc(size_t size)
+{
+    std::lock_guard<std::mutex> lock(gMemLock);
+    return mem_malloc(size);
+}
+
+static void *locked_mem_malloc_cacheline(size_t size)
+{
+    std::lock_guard<std::mutex> lock(gMemLock);
+    return mem_malloc_cacheline(size);
+}
+
+static void locked_mem_free(void *ptr)
+{
+    std::lock_guard<std::mutex> lock(gMemLock);
+    mem_free(ptr);
+}
+
+static const BenchAllocator kAllocators[] = {
+    {"glibc", malloc, free, false},
+    {"mem(locked)", locked_mem_malloc, locked_mem_free, true},
+    {"mem(lines)", locked_mem_malloc_cacheline, locked_mem_free, true},
+};
+
+// ----------------------------------------------------------------------
+// Workloads. Each returns the number of allocator operations performed,
+// a few also report a workload specific figure through extra.
+// ----------------------------------------------------------------------
+
+struct RunResult
+{
+    double ops_per_sec;
+    double peak_rss_mib;
+    double extra;
+};
+
+/*
+ * Larson server simulation: every thread owns a set of live blocks and keeps
+ * replacing random ones with blocks of random size. Between rounds the sets
+ * are passed on to the next thread, so most blocks are freed by a thread
+ * other than the one which allocated them.
+ */
+static size_t larson(const BenchAllocator &allocator, int threads, double *)
+{
+    const size_t slots = 1000;
+    const size_t ops_per_round = 50000;
+    const int rounds = 8;
+    std::vector<std::vector<void *>> sets(threads, std::vector<void *>(slots));
+    std::barrier sync(threads);
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            std::mt19937 rng(t + 1);
+
+            for (auto &p: sets[t]) {
+                p = allocator.alloc(16 + rng() % 496);
+            }
+
+            sync.arrive_and_wait();
+
+            for (int round = 0; round < rounds; ++round) {
+                auto &set = sets[(t + round) % threads];
+
+                for (size_t i = 0; i < ops_per_round; ++i) {
+                    size_t slot = rng() % slots;
+                    allocator.release(set[slot]);
+                    set[slot] = allocator.alloc(16 + rng() % 496);
+                }
+
+                sync.arrive_and_wait();
+            }
+        });
+    }
+
+    for (auto &worker: workers) {
+        worker.join();
+    }
+
+    for (auto &set: sets) {
+        for (auto p: set) {
+            allocator.release(p);
+        }
+    }
+
+    return size_t(threads) * rounds * ops_per_round * 2;
+}
+
+/*
+ * Producer/consumer: threads are paired, one side allocates and hands the
+ * blocks over a single producer single consumer ring, the other side frees
+ * them. A single thread plays both roles in turns, with an odd count the
+ * last thread stays idle.
+ */
+static size_t producer_consumer(const BenchAllocator &allocator, int threads, double *)
+{
+    const size_t blocks = 400000;
+    static constexpr size_t ring_size = 1024;
+
+    struct Ring
+    {
+        std::vector<void *> slots = std::vector<void *>(ring_size);
+        alignas(kCacheLine) std::atomic<size_t> head{0};
+        alignas(kCacheLine) std::atomic<size_t> tail{0};
+    };
+
+    if (threads == 1) {
+        std::vector<void *> batch(ring_size);
+
+        for (size_t done = 0; done < blocks; done += ring_size) {
+            for (auto &p: batch) {
+                p = allocator.alloc(64);
+            }
+
+            for (auto p: batch) {
+                allocator.release(p);
+            }
+        }
+
+        return blocks * 2;
+    }
+
+    int pairs = threads / 2;
+    std::vector<Ring> rings(pairs);
+    std::vector<std::thread> workers;
+
+    for (int pair = 0; pair < pairs; ++pair) {
+        auto &ring = rings[pair];
+
+        workers.emplace_back([&] {
+            for (size_t i = 0; i < blocks; ++i) {
+                void *p = allocator.alloc(64);
+                size_t head = ring.head.load(std::memory_order_relaxed);
+
+                while (head - ring.tail.load(std::memory_order_acquire) == ring_size) {
+                    std::this_thread::yield();
+                }
+
+                ring.slots[head % ring_size] = p;
+                ring.head.store(head + 1, std::memory_order_release);
+            }
+        });
+
+        workers.emplace_back([&] {
+            for (size_t i = 0; i < blocks; ++i) {
+                size_t tail = ring.tail.load(std::memory_order_relaxed);
+
+                while (ring.head.load(std::memory_order_acquire) == tail) {
+                    std::this_thread::yield();
+                }
+
+                allocator.release(ring.slots[tail % ring_size]);
+                ring.tail.store(tail + 1, std::memory_order_release);
+            }
+        });
+    }
+
+    for (auto &worker: workers) {
+        worker.join();
+    }
+
+    return size_t(pairs) * blocks * 2;
+}
+
+/* threadtest: every thread repeatedly allocates a batch of blocks and frees it */
+static size_t threadtest(const BenchAllocator &allocator, int threads, double *)
+{
+    const size_t batch_size = 10000;
+    const int iterations = 40;
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&] {
+            std::vector<void *> batch(batch_size);
+
+            for (int i = 0; i < iterations; ++i) {
+                for (auto &p: batch) {
+                    p = allocator.alloc(64);
+                }
+
+                for (auto p: batch) {
+                    allocator.release(p);
+                }
+            }
+        });
+    }
+
+    for (auto &worker: workers) {
+        worker.join();
+    }
+
+    return size_t(threads) * iterations * batch_size * 2;
+}
+
+/*
+ * False sharing detector: all threads allocate a small object at the same
+ * time and then hammer their own object. Objects of different threads
+ * placed on one cache line make the writes slow. extra receives the share
+ * of objects which have a neighbour from another thread on their line.
+ */
+static size_t false_sharing(const BenchAllocator &allocator, int threads, double *extra)
+{
+    const int rounds = 16;
+    const size_t writes = 2000000;
+    std::vector<volatile uint64_t *> objects(threads);
+    std::barrier sync(threads);
+    std::vector<std::thread> workers;
+    size_t shared = 0;
+
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int round = 0; round < rounds; ++round) {
+                objects[t] = static_cast<volatile uint64_t *>(allocator.alloc(sizeof(uint64_t)));
+                sync.arrive_and_wait();
+
+                for (size_t i = 0; i < writes; ++i) {
+                    *objects[t] = *objects[t] + 1;
+                }
+
+                sync.arrive_and_wait();
+
+                if (t == 0) {
+                    for (int a = 0; a < threads; ++a) {
+                        for (int b = 0; b < threads; ++b) {
+                            auto line_a = reinterpret_cast<uintptr_t>(objects[a]) / kCacheLine;
+                            auto line_b = reinterpret_cast<uintptr_t>(objects[b]) / kCacheLine;
+
+                            if (a != b && line_a == line_b) {
+                                ++shared;
+                                break;
+                            }
+                        }
+                    }
+                }
+
+                sync.arrive_and_wait();
+                allocator.release(const_cast<uint64_t *>(objects[t]));
+            }
+        });
+    }
+
+    for (auto &worker: workers) {
+        worker.join();
+    }
+
+    *extra = 100.0 * shared / (size_t(threads) * rounds);
+    return size_t(threads) * rounds * (writes + 2);
+}
+
+struct Workload
+{
+    const char *name;
+    size_t (*run)(const BenchAllocator &allocator, int threads, double *extra);
+    const char *extra_name;
+};
+
+static const Workload kWorkloads[] = {
+    {"larson", larson, nullptr},
+    {"producer_consumer", producer_consumer, nullptr},
+    {"threadtest", threadtest, nullptr},
+    {"false_sharing", false_sharing, "shared-lines%"},
+};
+
+// ----------------------------------------------------------------------
+// Driver
+// ----------------------------------------------------------------------
+
+static bool run_isolated(const Workload &workload, const BenchAllocator &allocator, int threads, RunResult *result)
+{
+    int fds[2];
+    /* The child must not inherit and repeat pending output */
+    fflush(stdout);
+
+    if (pipe(fds) != 0) {
+        return false;
+    }
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        close(fds[0]);
+        RunResult child{};
+
+        if (!allocator.uses_heap || mem_heap_map(kHeapSize) == 0) {
+            auto start = Clock::now();
+            size_t ops = workload.run(allocator, threads, &child.extra);
+            child.ops_per_sec = ops / elapsed_s(start);
+
+            rusage usage{};
+            getrusage(RUSAGE_SELF, &usage);
+            child.peak_rss_mib = usage.ru_maxrss / 1024.0;
+        }
+
+        bool written = write(fds[1], &child, sizeof(child)) == sizeof(child);
+        _exit(written && child.ops_per_sec > 0 ? 0 : 1);
+    }
+
+    close(fds[1]);
+    bool ok = pid > 0 && read(fds[0], result, sizeof(*result)) == sizeof(*result);
+    close(fds[0]);
+
+    int status = 0;
+    ok = ok && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : int(std::thread::hardware_concurrency());
+    max_threads = max_threads > 0 ? max_threads : 1;
+
+    std::vector<int> sweep;
+
+    for (int threads = 1; threads < max_threads; threads *= 2) {
+        sweep.push_back(threads);
+    }
+
+    sweep.push_back(max_threads);
+
+    printf("%-18s %-12s %7s %14s %10s %10s %14s\n",
+           "workload", "allocator", "threads", "ops/sec", "scaling", "rss(MiB)", "extra");
+
+    for (auto &workload: kWorkloads) {
+        for (auto &allocator: kAllocators) {
+            double single = 0;
+
+            for (int threads: sweep) {
+                RunResult result{};
+
+                if (!run_isolated(workload, allocator, threads, &result)) {
+                    printf("%-18s %-12s %7d %14s\n", workload.name, allocator.name, threads, "failed");
+                    continue;
+                }
+
+                single = threads == 1 ? result.ops_per_sec : single;
+                /* Throughput relative to perfect linear scaling of the single thread run */
+                double scaling = single > 0 ? result.ops_per_sec / (single * threads) : 0;
+
+                printf("%-18s %-12s %7d %14.0f %9.0f%% %10.1f", workload.name, allocator.name, threads,
+                       result.ops_per_sec, 100 * scaling, result.peak_rss_mib);
+
+                if (workload.extra_name) {
+                    printf(" %s=%.0f", workload.extra_name, result.extra);
+                }
+
+                printf("\n");
+            }
+        }
+    }
+
+    return 0;
+}
@@ -5,7 +5,17 @@
 #include <limits>
 #include <new> // for std::max_align_t
 #include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <thread>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include "memory.h"
+#include "object_pool.h"
+#include "fixed_alloc.h"
 
 #define LOG_TAG "test"
 #include "logging.h"
@@ -20,6 +30,14 @@
 
 #define HEAP_SIZE (4096 * 4096)
 
+static char *gTestHeap = nullptr;
+
+// Возвращает тесты к общей куче после тестов, которые создают свою
+static void reset_default_heap()
+{
+    mem_initialize(gTestHeap, HEAP_SIZE);
+}
+
 // Вспомогательная функция для проверки выравнивания указателя
 static bool is_aligned_to_max_align(void *ptr)
 {
@@ -661,9 +679,2101 @@ TEST(AlignedAllocation, VerifyStandardAlignment)
     }
 }
 
+// ----------------------------------------------------------------------
+// Тесты для кучи в файле
+// ----------------------------------------------------------------------
+
+TEST(HeapFileTest, ReopenKeepsData)
+{
+    const std::string path = ::testing::TempDir() + "allocator_heap_file_test.img";
+    const size_t size = 1024 * 1024;
+    const size_t count = 64;
+
+    ASSERT_EQ(mem_heap_create(path.c_str(), size), 0);
+    auto values = static_cast<uint64_t *>(mem_malloc(count * sizeof(uint64_t)));
+    ASSERT_NE(values, nullptr);
+    for (size_t i = 0; i < count; ++i) {
+        values[i] = i * 0x9E3779B97F4A7C15ULL;
+    }
+    mem_heap_set_root(values);
+    // Оставляем свободные блоки в корзинах, чтобы проверить и их
+    void *hole = mem_malloc(1000);
+    void *pin = mem_malloc(16);
+    mem_free(hole);
+    mem_heap_close();
+
+    // Занимаем освободившийся диапазон, чтобы образ отобразился по другому адресу
+    void *placeholder = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(placeholder, MAP_FAILED);
+
+    ASSERT_EQ(mem_heap_open(path.c_str()), 0);
+    EXPECT_TRUE(mem_check());
+    auto reopened = static_cast<uint64_t *>(mem_heap_root());
+    ASSERT_NE(reopened, nullptr);
+    for (size_t i = 0; i < count; ++i) {
+        ASSERT_EQ(reopened[i], i * 0x9E3779B97F4A7C15ULL);
+    }
+    void *p = mem_malloc(900);
+    ASSERT_NE(p, nullptr);
+    mem_free(p);
+    mem_free(reopened);
+    EXPECT_TRUE(mem_check());
+    (void) pin;
+
+    mem_heap_close();
+    munmap(placeholder, size);
+    unlink(path.c_str());
+    reset_default_heap();
+}
+
+TEST(HeapFileTest, RejectsForeignFile)
+{
+    const std::string path = ::testing::TempDir() + "allocator_heap_foreign.img";
+    {
+        std::ofstream out(path, std::ios::binary);
+        std::vector<char> garbage(64 * 1024, 'x');
+        out.write(garbage.data(), static_cast<std::streamsize>(garbage.size()));
+    }
+
+    EXPECT_EQ(mem_heap_open(path.c_str()), EINVAL);
+    EXPECT_EQ(mem_heap_open(nullptr), EINVAL);
+
+    // Текущая куча должна остаться рабочей
+    void *p = mem_malloc(100);
+    ASSERT_NE(p, nullptr);
+    mem_free(p);
+    unlink(path.c_str());
+}
+
+// ----------------------------------------------------------------------
+// Тесты для перемещаемых блоков и дефрагментации
+// ----------------------------------------------------------------------
+
+TEST(CompactTest, CompactionRecoversContiguousSpace)
+{
+    const size_t heap_size = 64 * 1024;
+    const size_t block_size = 1000;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+
+    // Заполняем кучу целиком
+    std::vector<mem_handle_t> handles;
+    for (mem_handle_t h = mem_handle_alloc(block_size); h != 0; h = mem_handle_alloc(block_size)) {
+        fill_pattern(mem_handle_lock(h), block_size, static_cast<unsigned char>(handles.size()));
+        mem_handle_unlock(h);
+        handles.push_back(h);
+    }
+    const size_t count = handles.size();
+    ASSERT_GT(count, 16u);
+
+    // Закреплённый блок не должен перемещаться
+    const size_t locked = (count / 2) | 1;
+    void *pinned = mem_handle_lock(handles[locked]);
+
+    for (size_t i = 0; i < count; i += 2) {
+        mem_handle_free(handles[i]);
+        handles[i] = 0;
+    }
+
+    EXPECT_EQ(mem_malloc(block_size * 8), nullptr);
+    EXPECT_GE(mem_compact(), block_size * 8);
+    EXPECT_TRUE(mem_check());
+
+    void *big = mem_malloc(block_size * 8);
+    EXPECT_NE(big, nullptr);
+    mem_free(big);
+
+    EXPECT_EQ(mem_handle_lock(handles[locked]), pinned);
+    mem_handle_unlock(handles[locked]);
+    mem_handle_unlock(handles[locked]);
+
+    for (size_t i = 1; i < count; i += 2) {
+        verify_pattern(mem_handle_lock(handles[i]), block_size, static_cast<unsigned char>(i));
+        mem_handle_unlock(handles[i]);
+        mem_handle_free(handles[i]);
+    }
+
+    EXPECT_EQ(mem_handle_lock(handles[1]), nullptr);
+    EXPECT_TRUE(mem_check());
+    reset_default_heap();
+}
+
+// ----------------------------------------------------------------------
+// Тесты для пошаговой проверки кучи
+// ----------------------------------------------------------------------
+
+TEST(CheckStepTest, PassCompletesWithinBudget)
+{
+    std::vector<void *> ptrs;
+    for (int i = 0; i < 64; ++i) {
+        ptrs.push_back(mem_malloc(16 + i * 8));
+    }
+    for (size_t i = 0; i < ptrs.size(); i += 3) {
+        mem_free(ptrs[i]);
+        ptrs[i] = nullptr;
+    }
+
+    size_t steps = 1;
+    MemCheckStatus status;
+    while ((status = mem_check_step(4)) == MEM_CHECK_IN_PROGRESS) {
+        ++steps;
+    }
+    EXPECT_EQ(status, MEM_CHECK_COMPLETE);
+    EXPECT_GT(steps, 10u);
+
+    for (void *p: ptrs) {
+        mem_free(p);
+    }
+}
+
+TEST(CheckStepTest, DetectsCorruptedMagic)
+{
+    auto p = static_cast<size_t *>(mem_malloc(64));
+    ASSERT_NE(p, nullptr);
+    size_t saved = p[-1];
+    p[-1] = 0;
+
+    MemCheckStatus status;
+    while ((status = mem_check_step(16)) == MEM_CHECK_IN_PROGRESS) {
+    }
+    EXPECT_EQ(status, MEM_CHECK_CORRUPTED);
+    EXPECT_FALSE(mem_check());
+
+    p[-1] = saved;
+    while ((status = mem_check_step(16)) == MEM_CHECK_IN_PROGRESS) {
+    }
+    EXPECT_EQ(status, MEM_CHECK_COMPLETE);
+    mem_free(p);
+}
+
+TEST(CheckStepTest, CursorSurvivesConcurrentChanges)
+{
+    std::vector<void *> ptrs(256, nullptr);
+    srand(42);
+
+    for (int iter = 0; iter < 20000; ++iter) {
+        size_t i = rand() % ptrs.size();
+        if (ptrs[i]) {
+            mem_free(ptrs[i]);
+            ptrs[i] = nullptr;
+        }
+        else {
+            ptrs[i] = mem_malloc(rand() % 512 + 1);
+        }
+        ASSERT_NE(mem_check_step(3), MEM_CHECK_CORRUPTED) << "iteration " << iter;
+    }
+
+    for (void *p: ptrs) {
+        mem_free(p);
+    }
+    EXPECT_TRUE(mem_check());
+}
+
+// ----------------------------------------------------------------------
+// Тесты для обхода кучи
+// ----------------------------------------------------------------------
+
+struct WalkTotals
+{
+    size_t allocated = 0;
+    size_t free = 0;
+    size_t free_bytes = 0;
+    size_t bad_bins = 0;
+    size_t unbinned = 0;
+};
+
+static bool count_blocks(const MemBlockInfo *info, void *ctx)
+{
+    auto totals = static_cast<WalkTotals *>(ctx);
+    if (info->state == MEM_BLOCK_ALLOCATED) {
+        ++totals->allocated;
+        totals->bad_bins += info->bin != MEM_NO_BIN;
+    }
+    else {
+        ++totals->free;
+        totals->free_bytes += info->size;
+        totals->unbinned += info->bin == MEM_NO_BIN;
+    }
+    return true;
+}
+
+TEST(WalkTest, HeapAndBinWalksAgree)
+{
+    std::vector<void *> ptrs;
+    for (int i = 0; i < 32; ++i) {
+        ptrs.push_back(mem_malloc(32 + i * 16));
+    }
+    for (size_t i = 0; i < ptrs.size(); i += 2) {
+        mem_free(ptrs[i]);
+    }
+
+    WalkTotals heap_totals;
+    WalkTotals bin_totals;
+    size_t blocks = mem_heap_walk(count_blocks, &heap_totals);
+    size_t bins = mem_bin_walk(count_blocks, &bin_totals);
+
+    EXPECT_EQ(blocks, heap_totals.allocated + heap_totals.free);
+    EXPECT_GE(heap_totals.allocated, 16u);
+    EXPECT_EQ(heap_totals.bad_bins, 0u);
+    // Жертва и вершина не лежат ни в одной корзине
+    EXPECT_GE(heap_totals.unbinned, 1u);
+    EXPECT_LE(heap_totals.unbinned, 2u);
+    EXPECT_EQ(bin_totals.unbinned, heap_totals.unbinned);
+    EXPECT_EQ(bins, heap_totals.free);
+    EXPECT_EQ(bin_totals.allocated, 0u);
+    EXPECT_EQ(bin_totals.free_bytes, heap_totals.free_bytes);
+
+    for (size_t i = 1; i < ptrs.size(); i += 2) {
+        mem_free(ptrs[i]);
+    }
+}
+
+TEST(WalkTest, CallbackStopsWalk)
+{
+    void *p = mem_malloc(100);
+    size_t visited = mem_heap_walk([](const MemBlockInfo *, void *) { return false; }, nullptr);
+    EXPECT_EQ(visited, 1u);
+    mem_free(p);
+}
+
+// ----------------------------------------------------------------------
+// Тесты для больших блоков в отдельных отображениях
+// ----------------------------------------------------------------------
+
+static bool in_test_heap(void *p)
+{
+    auto c = static_cast<char *>(p);
+    return c >= gTestHeap && c < gTestHeap + HEAP_SIZE;
+}
+
+TEST(MmapTest, LargeBlocksBypassHeap)
+{
+    const size_t threshold = 256 * 1024;
+    mem_set_mmap_threshold(threshold);
+
+    void *small = mem_malloc(threshold - 1);
+    ASSERT_NE(small, nullptr);
+    EXPECT_TRUE(in_test_heap(small));
+    mem_free(small);
+
+    const size_t size = 1024 * 1024;
+    void *p = mem_malloc(size);
+    ASSERT_NE(p, nullptr);
+    EXPECT_FALSE(in_test_heap(p));
+    fill_pattern(p, size, 0x21);
+
+    void *grown = mem_realloc(p, 4 * size);
+    ASSERT_NE(grown, nullptr);
+    EXPECT_FALSE(in_test_heap(grown));
+    verify_pattern(grown, size, 0x21);
+
+    void *shrunk = mem_realloc(grown, 100);
+    ASSERT_NE(shrunk, nullptr);
+    EXPECT_TRUE(in_test_heap(shrunk));
+    verify_pattern(shrunk, 100, 0x21);
+    mem_free(shrunk);
+
+    auto zeroed = static_cast<unsigned char *>(mem_calloc(size, 2));
+    ASSERT_NE(zeroed, nullptr);
+    EXPECT_FALSE(in_test_heap(zeroed));
+    for (size_t i = 0; i < 2 * size; i += 4096) {
+        ASSERT_EQ(zeroed[i], 0);
+    }
+    mem_free(zeroed);
+
+    void *aligned = mem_malloc_aligned(size, 4096);
+    ASSERT_NE(aligned, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(aligned) % 4096, 0u);
+    mem_free(aligned);
+
+    mem_set_mmap_threshold(0);
+    EXPECT_TRUE(mem_check());
+}
+
+// ----------------------------------------------------------------------
+// Тесты для кучи на больших страницах
+// ----------------------------------------------------------------------
+
+TEST(HugePageTest, MappedHeapServesAllocations)
+{
+    const size_t size = 16 * 1024 * 1024;
+    ASSERT_EQ(mem_heap_map(size), 0);
+
+    void *small = mem_malloc(100);
+    ASSERT_NE(small, nullptr);
+
+    // Большие блоки выравниваются по границе большой страницы
+    const size_t page = mem_heap_huge_page_size();
+    void *large = mem_malloc(4 * 1024 * 1024);
+    ASSERT_NE(large, nullptr);
+    if (page) {
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(large) % page, 0u);
+    }
+    fill_pattern(large, 4 * 1024 * 1024, 0x42);
+    EXPECT_TRUE(mem_check());
+
+    mem_free(large);
+    mem_free(small);
+    EXPECT_TRUE(mem_check());
+    mem_heap_close();
+    reset_default_heap();
+}
+
+// ----------------------------------------------------------------------
+// Тесты для calloc на заведомо нулевой памяти
+// ----------------------------------------------------------------------
+
+TEST(CallocTest, ReusedBlocksAreCleared)
+{
+    const size_t size = 4096;
+    void *p = mem_malloc(size);
+    ASSERT_NE(p, nullptr);
+    memset(p, 0xFF, size);
+    mem_free(p);
+
+    auto bytes = static_cast<unsigned char *>(mem_calloc(size, 1));
+    ASSERT_NE(bytes, nullptr);
+    for (size_t i = 0; i < size; ++i) {
+        ASSERT_EQ(bytes[i], 0) << "byte at offset " << i << " is not zero";
+    }
+    mem_free(bytes);
+}
+
+TEST(CallocTest, KnownZeroMemoryIsNotCleared)
+{
+    const size_t heap_size = 1024 * 1024;
+    std::vector<unsigned char> heap(heap_size, 0);
+    ASSERT_EQ(mem_initialize(heap.data(), heap_size, MEM_INIT_ZEROED), 0);
+
+    void *first = mem_malloc(64);
+    ASSERT_NE(first, nullptr);
+
+    // Метка в нетронутой части кучи: calloc не должен её стирать
+    const size_t marker = heap_size / 2;
+    heap[marker] = 0x5A;
+    auto bytes = static_cast<unsigned char *>(mem_calloc(heap_size - 64 * 1024, 1));
+    ASSERT_NE(bytes, nullptr);
+    ASSERT_LT(bytes, heap.data() + marker);
+    EXPECT_EQ(bytes[0], 0);
+    EXPECT_EQ(heap[marker], 0x5A);
+    heap[marker] = 0;
+
+    mem_free(bytes);
+    mem_free(first);
+    EXPECT_TRUE(mem_check());
+    reset_default_heap();
+}
+
+// ----------------------------------------------------------------------
+// Тесты для потокового копирования и обнуления
+// ----------------------------------------------------------------------
+
+TEST(StreamTest, ReallocCopiesWithStreamingStores)
+{
+    mem_set_stream_threshold(1);
+
+    // Разные размеры и смещения, чтобы пройти по началу, телу и хвосту
+    for (size_t size: {1u, 63u, 64u, 257u, 4095u, 100000u}) {
+        auto p = static_cast<unsigned char *>(mem_malloc_aligned(size, 16));
+        ASSERT_NE(p, nullptr);
+        fill_pattern(p, size, static_cast<unsigned char>(size));
+
+        auto q = static_cast<unsigned char *>(mem_realloc(p, size * 2 + 24));
+        ASSERT_NE(q, nullptr);
+        verify_pattern(q, size, static_cast<unsigned char>(size));
+        mem_free(q);
+    }
+
+    mem_set_stream_threshold(1024 * 1024);
+    EXPECT_TRUE(mem_check());
+}
+
+TEST(StreamTest, CallocClearsWithStreamingStores)
+{
+    mem_set_stream_threshold(1);
+
+    for (size_t size: {24u, 200u, 5000u, 123457u}) {
+        void *p = mem_malloc(size);
+        ASSERT_NE(p, nullptr);
+        memset(p, 0xEE, size);
+        mem_free(p);
+
+        auto bytes = static_cast<unsigned char *>(mem_calloc(size, 1));
+        ASSERT_NE(bytes, nullptr);
+        for (size_t i = 0; i < size; ++i) {
+            ASSERT_EQ(bytes[i], 0) << "byte at offset " << i << " of " << size;
+        }
+        mem_free(bytes);
+    }
+
+    mem_set_stream_threshold(1024 * 1024);
+    EXPECT_TRUE(mem_check());
+}
+
+TEST(StreamTest, CompactionMovesOverlappingBlocks)
+{
+    const size_t heap_size = 64 * 1024;
+    const size_t block_size = 3000;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+    mem_set_stream_threshold(1);
+
+    // Маленькая дыра перед большим блоком: источник и приёмник перекрываются
+    mem_handle_t hole = mem_handle_alloc(64);
+    mem_handle_t moved = mem_handle_alloc(block_size);
+    ASSERT_NE(hole, 0u);
+    ASSERT_NE(moved, 0u);
+    fill_pattern(mem_handle_lock(moved), block_size, 7);
+    mem_handle_unlock(moved);
+    mem_handle_free(hole);
+
+    mem_compact();
+    EXPECT_TRUE(mem_check());
+    verify_pattern(mem_handle_lock(moved), block_size, 7);
+    mem_handle_unlock(moved);
+    mem_handle_free(moved);
+
+    mem_set_stream_threshold(1024 * 1024);
+    reset_default_heap();
+}
+
+// ----------------------------------------------------------------------
+// Тесты для профилировщика кучи
+// ----------------------------------------------------------------------
+
+struct ProfileTotals
+{
+    size_t live_count = 0;
+    size_t live_bytes = 0;
+    size_t alloc_count = 0;
+    size_t alloc_bytes = 0;
+    size_t period = 0;
+    size_t stacks = 0;
+    bool has_maps = false;
+};
+
+static ProfileTotals dump_profile()
+{
+    ProfileTotals totals;
+    FILE *file = tmpfile();
+    EXPECT_NE(file, nullptr);
+    EXPECT_EQ(mem_profile_dump(fileno(file)), 0);
+
+    std::string text(static_cast<size_t>(lseek(fileno(file), 0, SEEK_END)), '\0');
+    EXPECT_EQ(pread(fileno(file), text.data(), text.size(), 0), static_cast<ssize_t>(text.size()));
+    fclose(file);
+
+    std::istringstream lines(text);
+    std::string line;
+    std::getline(lines, line);
+    EXPECT_EQ(sscanf(line.c_str(), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu",
+                     &totals.live_count, &totals.live_bytes, &totals.alloc_count,
+                     &totals.alloc_bytes, &totals.period), 5) << line;
+
+    while (std::getline(lines, line)) {
+        if (line.find("] @ 0x") != std::string::npos) {
+            ++totals.stacks;
+        }
+        totals.has_maps |= line == "MAPPED_LIBRARIES:";
+    }
+
+    return totals;
+}
+
+TEST(ProfileTest, TracksLiveAndCumulativeSamples)
+{
+    // Период в 1 байт: выбирается практически каждое выделение
+    ASSERT_EQ(mem_profile_start(1), 0);
+
+    std::vector<void *> ptrs;
+    for (int i = 0; i < 100; ++i) {
+        ptrs.push_back(mem_malloc(64 + i));
+    }
+
+    ProfileTotals live = dump_profile();
+    EXPECT_EQ(live.period, 1u);
+    EXPECT_GE(live.live_count, 90u);
+    EXPECT_EQ(live.live_count, live.alloc_count);
+    EXPECT_GT(live.stacks, 0u);
+    EXPECT_TRUE(live.has_maps);
+
+    for (void *p: ptrs) {
+        mem_free(p);
+    }
+
+    ProfileTotals freed = dump_profile();
+    EXPECT_EQ(freed.live_count, 0u);
+    EXPECT_EQ(freed.live_bytes, 0u);
+    EXPECT_EQ(freed.alloc_count, live.alloc_count);
+    EXPECT_EQ(freed.alloc_bytes, live.alloc_bytes);
+
+    mem_profile_stop();
+    void *p = mem_malloc(128);
+    EXPECT_EQ(dump_profile().alloc_count, live.alloc_count);
+    mem_free(p);
+}
+
+TEST(ProfileTest, FreesAfterStopLeaveLiveSamples)
+{
+    ASSERT_EQ(mem_profile_start(1), 0);
+
+    std::vector<void *> ptrs;
+    for (int i = 0; i < 50; ++i) {
+        ptrs.push_back(mem_malloc(128));
+    }
+
+    mem_profile_stop();
+    ASSERT_GT(dump_profile().live_count, 0u);
+
+    for (void *p: ptrs) {
+        mem_free(p);
+    }
+
+    // Заголовок хранит период последнего сеанса, освобождённые блоки не остаются живыми
+    ProfileTotals stopped = dump_profile();
+    EXPECT_EQ(stopped.period, 1u);
+    EXPECT_EQ(stopped.live_count, 0u);
+    EXPECT_EQ(stopped.live_bytes, 0u);
+    EXPECT_GE(stopped.alloc_count, 45u);
+}
+
+TEST(ProfileTest, SamplesAboutOncePerPeriod)
+{
+    const size_t period = 4096;
+    const size_t size = 64;
+    const size_t count = 20000;
+    ASSERT_EQ(mem_profile_start(period), 0);
+
+    std::vector<void *> ptrs;
+    for (size_t i = 0; i < count; ++i) {
+        ptrs.push_back(mem_malloc(size));
+    }
+
+    // Ожидаем около size * count / period выборок
+    size_t expected = size * count / period;
+    ProfileTotals totals = dump_profile();
+    EXPECT_GT(totals.alloc_count, expected / 2);
+    EXPECT_LT(totals.alloc_count, expected * 2);
+
+    // Перевыделение переносит выборку на новый блок
+    for (auto &p: ptrs) {
+        p = mem_realloc(p, size * 2);
+        ASSERT_NE(p, nullptr);
+    }
+    for (void *p: ptrs) {
+        mem_free(p);
+    }
+
+    EXPECT_EQ(dump_profile().live_count, 0u);
+    mem_profile_stop();
+    EXPECT_EQ(mem_profile_start(0), EINVAL);
+    EXPECT_TRUE(mem_check());
+}
+
+// ----------------------------------------------------------------------
+// Тесты для арен
+// ----------------------------------------------------------------------
+
+TEST(ArenaTest, BumpAllocationsAreContiguousAndAligned)
+{
+    MemArena *arena = mem_arena_create(4096);
+    ASSERT_NE(arena, nullptr);
+
+    auto a = static_cast<char *>(mem_arena_alloc(arena, 24));
+    auto b = static_cast<char *>(mem_arena_alloc(arena, 8, 8));
+    auto c = static_cast<char *>(mem_arena_alloc(arena, 100, 64));
+    ASSERT_NE(a, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(a) % 16, 0u);
+    EXPECT_EQ(b, a + 24);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(c) % 64, 0u);
+    EXPECT_LT(c - b, 64 + 8);
+
+    // Запрос больше размера чанка получает собственный чанк
+    auto big = static_cast<char *>(mem_arena_alloc(arena, 10000, 256));
+    ASSERT_NE(big, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(big) % 256, 0u);
+    memset(big, 0x11, 10000);
+
+    EXPECT_EQ(mem_arena_alloc(arena, 16, 3), nullptr);
+    mem_arena_destroy(arena);
+    EXPECT_TRUE(mem_check());
+}
+
+TEST(ArenaTest, ResetReusesFirstChunkAndFreesTheRest)
+{
+    size_t largest = 0;
+    mem_heap_walk([](const MemBlockInfo *info, void *ctx) {
+        auto largest = static_cast<size_t *>(ctx);
+        if (info->state == MEM_BLOCK_FREE) {
+            *largest = info->size > *largest ? info->size : *largest;
+        }
+        return true;
+    }, &largest);
+
+    MemArena *arena = mem_arena_create(1024);
+    ASSERT_NE(arena, nullptr);
+    void *first = mem_arena_alloc(arena, 64);
+
+    for (int round = 0; round < 3; ++round) {
+        for (int i = 0; i < 1000; ++i) {
+            auto p = static_cast<unsigned char *>(mem_arena_alloc(arena, 48));
+            ASSERT_NE(p, nullptr);
+            fill_pattern(p, 48, static_cast<unsigned char>(i));
+        }
+
+        mem_arena_reset(arena);
+        EXPECT_EQ(mem_arena_alloc(arena, 64), first);
+        EXPECT_TRUE(mem_check());
+    }
+
+    mem_arena_destroy(arena);
+
+    size_t after = 0;
+    mem_heap_walk([](const MemBlockInfo *info, void *ctx) {
+        auto largest = static_cast<size_t *>(ctx);
+        if (info->state == MEM_BLOCK_FREE) {
+            *largest = info->size > *largest ? info->size : *largest;
+        }
+        return true;
+    }, &after);
+    EXPECT_EQ(after, largest);
+}
+
+// ----------------------------------------------------------------------
+// Тесты для пула объектов
+// ----------------------------------------------------------------------
+
+struct alignas(32) PoolNode
+{
+    static int live;
+
+    PoolNode(int key, PoolNode *left) : key(key), left(left)
+    {
+        ++live;
+    }
+
+    ~PoolNode()
+    {
+        --live;
+    }
+
+    int key;
+    PoolNode *left;
+};
+
+int PoolNode::live = 0;
+
+TEST(ObjectPoolTest, CreateForwardsArgumentsAndReusesSlots)
+{
+    static_assert(ObjectPool<PoolNode>::kSlotSize == 32);
+    static_assert(ObjectPool<PoolNode>::kSlotAlignment == 32);
+    static_assert(ObjectPool<char>::kSlotSize == sizeof(void *));
+
+    {
+        ObjectPool<PoolNode, 16> pool;
+        std::vector<PoolNode *> nodes;
+        PoolNode *prev = nullptr;
+
+        // Несколько чанков
+        for (int i = 0; i < 100; ++i) {
+            PoolNode *node = pool.create(i, prev);
+            ASSERT_NE(node, nullptr);
+            EXPECT_EQ(reinterpret_cast<uintptr_t>(node) % alignof(PoolNode), 0u);
+            EXPECT_EQ(node->key, i);
+            EXPECT_EQ(node->left, prev);
+            nodes.push_back(node);
+            prev = node;
+        }
+        EXPECT_EQ(PoolNode::live, 100);
+
+        PoolNode *freed = nodes[42];
+        pool.destroy(freed);
+        EXPECT_EQ(PoolNode::live, 99);
+        EXPECT_EQ(pool.create(7, nullptr), freed);
+
+        for (PoolNode *node: nodes) {
+            pool.destroy(node);
+        }
+        EXPECT_EQ(PoolNode::live, 0);
+        EXPECT_TRUE(mem_check());
+    }
+
+    EXPECT_TRUE(mem_check());
+}
+
+// ----------------------------------------------------------------------
+// Тесты для выравнивания по кэш-линиям
+// ----------------------------------------------------------------------
+
+// Блок занимает целые кэш-линии, если начинается и заканчивается на их границе
+static bool owns_cache_lines(void *p)
+{
+    MemBlockInfo found{p, 0, MEM_BLOCK_FREE, MEM_NO_BIN};
+    mem_heap_walk([](const MemBlockInfo *info, void *ctx) {
+        auto found = static_cast<MemBlockInfo *>(ctx);
+        if (info->address == found->address) {
+            *found = *info;
+            return false;
+        }
+        return true;
+    }, &found);
+    return found.state == MEM_BLOCK_ALLOCATED && reinterpret_cast<uintptr_t>(p) % 64 == 0 && found.size % 64 == 0;
+}
+
+TEST(CacheLineTest, CachelineBlocksNeverShareLines)
+{
+    std::vector<void *> small;
+    std::vector<void *> lines;
+
+    // Чередуем обычные блоки и блоки по кэш-линиям, чтобы получить все смещения
+    for (size_t i = 0; i < 200; ++i) {
+        small.push_back(mem_malloc(8 + (i % 5) * 16));
+        void *p = mem_malloc_cacheline(8 + i * 3);
+        ASSERT_NE(p, nullptr);
+        EXPECT_TRUE(owns_cache_lines(p)) << "block " << i;
+        memset(p, 0x5A, 8 + i * 3);
+        lines.push_back(p);
+    }
+    EXPECT_TRUE(mem_check());
+
+    for (size_t i = 0; i < lines.size(); ++i) {
+        mem_free(lines[i]);
+        mem_free(small[i]);
+    }
+    EXPECT_TRUE(mem_check());
+}
+
+TEST(CacheLineTest, ThresholdRoundsLargeAllocations)
+{
+    mem_set_cacheline_threshold(256);
+    std::vector<void *> ptrs;
+
+    for (size_t i = 0; i < 100; ++i) {
+        size_t size = i % 2 ? 256 + i * 7 : 24;
+        void *p = mem_malloc(size);
+        ASSERT_NE(p, nullptr);
+        if (size >= 256) {
+            EXPECT_TRUE(owns_cache_lines(p)) << "size " << size;
+        }
+        ptrs.push_back(p);
+    }
+
+    mem_set_cacheline_threshold(0);
+    EXPECT_TRUE(mem_check());
+
+    for (void *p: ptrs) {
+        mem_free(p);
+    }
+    EXPECT_TRUE(mem_check());
+}
+
+TEST(CacheLineTest, MappedBlocksStayOnLines)
+{
+    const size_t threshold = 64 * 1024;
+    mem_set_mmap_threshold(threshold);
+    mem_set_cacheline_threshold(256);
+
+    // Блоки выше порога отображаются отдельно и тоже должны начинаться с кэш-линии
+    void *line = mem_malloc_cacheline(threshold);
+    void *large = mem_malloc(2 * threshold);
+    ASSERT_NE(line, nullptr);
+    ASSERT_NE(large, nullptr);
+    EXPECT_FALSE(in_test_heap(line));
+    EXPECT_FALSE(in_test_heap(large));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(line) % 64, 0u);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(large) % 64, 0u);
+    fill_pattern(line, threshold, 0x3C);
+
+    void *grown = mem_realloc(line, 4 * threshold);
+    ASSERT_NE(grown, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(grown) % 64, 0u);
+    verify_pattern(grown, threshold, 0x3C);
+
+    mem_free(grown);
+    mem_free(large);
+    mem_set_cacheline_threshold(0);
+    mem_set_mmap_threshold(0);
+    EXPECT_TRUE(mem_check());
+}
+
+// ----------------------------------------------------------------------
+// Тесты для компактных метаданных
+// ----------------------------------------------------------------------
+
+TEST(LayoutTest, SmallBlockStride)
+{
+#if defined(COMPACT_METADATA)
+    const ptrdiff_t expected_stride = 32;
+#else
+    const ptrdiff_t expected_stride = 64;
+#endif
+    const size_t heap_size = 64 * 1024;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+
+    auto a = static_cast<char *>(mem_malloc(16));
+    auto b = static_cast<char *>(mem_malloc(16));
+    ASSERT_NE(a, nullptr);
+    ASSERT_NE(b, nullptr);
+    EXPECT_EQ(b - a, expected_stride);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(a) % 16, 0u);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(b) % 16, 0u);
+
+    mem_free(a);
+    mem_free(b);
+    EXPECT_TRUE(mem_check());
+    reset_default_heap();
+}
+
+// ----------------------------------------------------------------------
+// Тесты для остатка последнего разбиения (victim)
+// ----------------------------------------------------------------------
+
+// Адрес блока, следующего в куче за p
+static void *next_block_address(void *p)
+{
+    struct Search
+    {
+        void *target;
+        bool found;
+        void *next;
+    } search{p, false, nullptr};
+
+    mem_heap_walk([](const MemBlockInfo *info, void *ctx) {
+        auto search = static_cast<Search *>(ctx);
+        if (search->found) {
+            search->next = info->address;
+            return false;
+        }
+        search->found = info->address == search->target;
+        return true;
+    }, &search);
+    return search.next;
+}
+
+TEST(VictimTest, MixedSmallAllocationsStayAdjacent)
+{
+    const size_t heap_size = 256 * 1024;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+
+    // Дыры в малой корзине, которые подошли бы любому запросу ниже
+    std::vector<void *> big;
+    for (int i = 0; i < 16; ++i) {
+        big.push_back(mem_malloc(120));
+    }
+    // Большая дыра, остаток которой станет жертвой, вершина кучи отгорожена
+    void *hole = mem_malloc(1024);
+    void *guard = mem_malloc(120);
+    ASSERT_NE(guard, nullptr);
+    for (size_t i = 0; i < big.size(); i += 2) {
+        mem_free(big[i]);
+    }
+    mem_free(hole);
+
+    // Разные размеры подряд нарезаются из одного остатка, а не из дыр
+    void *prev = mem_malloc(200);
+    ASSERT_NE(prev, nullptr);
+    std::vector<void *> small{prev};
+    for (size_t size: {40u, 24u, 100u, 64u, 150u}) {
+        void *p = mem_malloc(size);
+        ASSERT_NE(p, nullptr);
+        EXPECT_EQ(p, next_block_address(prev)) << "size " << size;
+        prev = p;
+        small.push_back(p);
+    }
+    EXPECT_TRUE(mem_check());
+
+    // Освобождение рядом с остатком сливается с ним, кучи и корзины согласованы
+    mem_free(small.back());
+    small.pop_back();
+    WalkTotals heap_totals;
+    WalkTotals bin_totals;
+    mem_heap_walk(count_blocks, &heap_totals);
+    EXPECT_EQ(mem_bin_walk(count_blocks, &bin_totals), heap_totals.free);
+    EXPECT_EQ(bin_totals.free_bytes, heap_totals.free_bytes);
+    EXPECT_TRUE(mem_check());
+
+    for (void *p: small) {
+        mem_free(p);
+    }
+    for (size_t i = 1; i < big.size(); i += 2) {
+        mem_free(big[i]);
+    }
+    mem_free(guard);
+    EXPECT_TRUE(mem_check());
+
+    // После освобождения всего снова доступна почти вся куча
+    void *all = mem_malloc(heap_size / 2);
+    EXPECT_NE(all, nullptr);
+    mem_free(all);
+    reset_default_heap();
+}
+
+// ----------------------------------------------------------------------
+// Вершина кучи
+// ----------------------------------------------------------------------
+
+TEST(TopTest, FreshMemoryIsBumpedFromTop)
+{
+    const size_t heap_size = 256 * 1024;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+
+    // Пока корзины пусты, блоки любых размеров идут подряд с вершины
+    void *prev = mem_malloc(64);
+    ASSERT_NE(prev, nullptr);
+    std::vector<void *> blocks{prev};
+    for (size_t size: {5000u, 24u, 300u, 1000u, 16u}) {
+        void *p = mem_malloc(size);
+        ASSERT_NE(p, nullptr);
+        EXPECT_EQ(p, next_block_address(prev)) << "size " << size;
+        prev = p;
+        blocks.push_back(p);
+    }
+
+    // Единственный свободный блок это вершина, обход корзин её находит
+    WalkTotals heap_totals;
+    WalkTotals bin_totals;
+    mem_heap_walk(count_blocks, &heap_totals);
+    EXPECT_EQ(heap_totals.free, 1u);
+    EXPECT_EQ(mem_bin_walk(count_blocks, &bin_totals), 1u);
+    EXPECT_EQ(bin_totals.free_bytes, heap_totals.free_bytes);
+    EXPECT_TRUE(mem_check());
+
+    // Последний блок сливается с вершиной, дыра в середине уходит в корзину
+    mem_free(blocks[1]);
+    mem_free(blocks.back());
+    blocks.pop_back();
+    heap_totals = WalkTotals();
+    bin_totals = WalkTotals();
+    mem_heap_walk(count_blocks, &heap_totals);
+    EXPECT_EQ(heap_totals.free, 2u);
+    EXPECT_EQ(mem_bin_walk(count_blocks, &bin_totals), 2u);
+    EXPECT_EQ(bin_totals.free_bytes, heap_totals.free_bytes);
+    EXPECT_TRUE(mem_check());
+
+    // Запрос, для которого нет дыры, снова берётся с вершины
+    void *top = mem_malloc(8000);
+    EXPECT_EQ(top, next_block_address(blocks.back()));
+    mem_free(top);
+
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (i != 1) {
+            mem_free(blocks[i]);
+        }
+    }
+    EXPECT_TRUE(mem_check());
+    void *all = mem_malloc(heap_size / 2);
+    EXPECT_NE(all, nullptr);
+    mem_free(all);
+    reset_default_heap();
+}
+
+// ----------------------------------------------------------------------
+// Предварительная загрузка страниц
+// ----------------------------------------------------------------------
+
+// Число страниц диапазона, которые уже в памяти
+static size_t resident_pages(void *base, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> pages((size + page - 1) / page);
+    if (mincore(base, size, pages.data()) != 0) {
+        return 0;
+    }
+    size_t count = 0;
+    for (auto state: pages) {
+        count += state & 1;
+    }
+    return count;
+}
+
+static void *map_fresh_pages(size_t size)
+{
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return nullptr;
+    }
+#if defined(MADV_NOHUGEPAGE)
+    madvise(base, size, MADV_NOHUGEPAGE);
+#endif
+    return base;
+}
+
+TEST(PrefaultTest, InitializeFaultsInWholeHeap)
+{
+    const size_t heap_size = 4 * 1024 * 1024;
+    const size_t page = sysconf(_SC_PAGESIZE);
+    void *base = map_fresh_pages(heap_size);
+    ASSERT_NE(base, nullptr);
+
+    ASSERT_EQ(mem_initialize(base, heap_size, MEM_INIT_ZEROED | MEM_INIT_PREFAULT), 0);
+    EXPECT_EQ(resident_pages(base, heap_size), heap_size / page);
+
+    // Содержимое не изменилось, память по-прежнему нулевая
+    auto p = static_cast<unsigned char *>(mem_calloc(heap_size / 2, 1));
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(p[0], 0);
+    EXPECT_EQ(p[heap_size / 2 - 1], 0);
+    mem_free(p);
+    EXPECT_TRUE(mem_check());
+
+    // Блокировка в памяти может быть запрещена лимитом RLIMIT_MEMLOCK
+    int locked = mem_initialize(base, heap_size, MEM_INIT_LOCK);
+    if (locked == 0) {
+        EXPECT_EQ(resident_pages(base, heap_size), heap_size / page);
+        EXPECT_NE(mem_malloc(64), nullptr);
+        EXPECT_TRUE(mem_check());
+    }
+    else {
+        EXPECT_TRUE(locked == ENOMEM || locked == EPERM || locked == EAGAIN) << locked;
+        EXPECT_EQ(mem_malloc(64), nullptr);
+    }
+
+    reset_default_heap();
+    munmap(base, heap_size);
+}
+
+TEST(PrefaultTest, PrefaultWarmsPrefix)
+{
+    const size_t heap_size = 4 * 1024 * 1024;
+    const size_t page = sysconf(_SC_PAGESIZE);
+    void *base = map_fresh_pages(heap_size);
+    ASSERT_NE(base, nullptr);
+
+    ASSERT_EQ(mem_initialize(base, heap_size, MEM_INIT_ZEROED), 0);
+    EXPECT_LT(resident_pages(base, heap_size), heap_size / page / 2);
+
+    // Прогревается только начало кучи
+    EXPECT_EQ(mem_prefault(heap_size / 4), heap_size / 4);
+    EXPECT_EQ(resident_pages(base, heap_size / 4), heap_size / 4 / page);
+    EXPECT_LT(resident_pages(base, heap_size), heap_size / page / 2);
+
+    // Запрос больше кучи ограничивается её размером
+    size_t warmed = mem_prefault(heap_size * 2);
+    EXPECT_LT(warmed, heap_size);
+    EXPECT_GT(warmed, heap_size - page);
+    EXPECT_TRUE(mem_check());
+
+    reset_default_heap();
+    munmap(base, heap_size);
+    mem_unuinitialize();
+    EXPECT_EQ(mem_prefault(heap_size), 0u);
+    reset_default_heap();
+}
+
+// ----------------------------------------------------------------------
+// Гистограммы задержек
+// ----------------------------------------------------------------------
+
+#if defined(MEM_LATENCY_STATS)
+static uint64_t latency_count(const MemLatencyStats &stats, MemLatencyOp op, int size_class = -1)
+{
+    uint64_t count = 0;
+    for (int c = 0; c < MEM_LATENCY_SIZE_CLASSES; ++c) {
+        if (size_class < 0 || size_class == c) {
+            for (int b = 0; b < MEM_LATENCY_BUCKETS; ++b) {
+                count += stats.counts[op][c][b];
+            }
+        }
+    }
+    return count;
+}
+
+TEST(LatencyTest, CountsOutermostOperations)
+{
+    mem_latency_reset();
+
+    void *small = mem_malloc(32);
+    void *large = mem_malloc(100000);
+    void *aligned = mem_malloc_aligned(100, 64);
+    // Вложенные mem_malloc() и mem_free() считаются только как mem_realloc()
+    small = mem_realloc(small, 200);
+    ASSERT_NE(small, nullptr);
+    mem_free(small);
+    mem_free(large);
+    mem_free(aligned);
+    usleep(1000);
+
+    MemLatencyStats stats;
+    mem_latency_snapshot(&stats);
+    EXPECT_EQ(latency_count(stats, MEM_LATENCY_MALLOC), 2u);
+    EXPECT_EQ(latency_count(stats, MEM_LATENCY_MALLOC, 0), 1u);
+    EXPECT_EQ(latency_count(stats, MEM_LATENCY_MALLOC, 6), 1u);
+    EXPECT_EQ(latency_count(stats, MEM_LATENCY_MALLOC_ALIGNED, 1), 1u);
+    EXPECT_EQ(latency_count(stats, MEM_LATENCY_REALLOC, 1), 1u);
+    EXPECT_EQ(latency_count(stats, MEM_LATENCY_FREE), 3u);
+    EXPECT_GT(stats.ticks_per_second, 0u);
+
+    mem_latency_reset();
+    mem_latency_snapshot(&stats);
+    for (int op = 0; op < MEM_LATENCY_OP_COUNT; ++op) {
+        EXPECT_EQ(latency_count(stats, MemLatencyOp(op)), 0u);
+    }
+}
+
+TEST(LatencyTest, CountsPlacementVariantsAsMalloc)
+{
+    mem_latency_reset();
+
+    // Запасной путь через mem_malloc() не должен считаться дважды
+    void *cacheline = mem_malloc_cacheline(100);
+    void *hint = mem_malloc_hint(100, 1000);
+    void *fallback = mem_malloc_cacheline(0);
+    mem_free(cacheline);
+    mem_free(hint);
+    mem_free(fallback);
+
+    MemLatencyStats stats;
+    mem_latency_snapshot(&stats);
+    EXPECT_EQ(latency_count(stats, MEM_LATENCY_MALLOC), 3u);
+    EXPECT_EQ(latency_count(stats, MEM_LATENCY_MALLOC, 1), 2u);
+    EXPECT_EQ(latency_count(stats, MEM_LATENCY_MALLOC_ALIGNED), 0u);
+}
+#endif
+
+// ----------------------------------------------------------------------
+// Двоичный снимок кучи
+// ----------------------------------------------------------------------
+
+TEST(SnapshotTest, DumpMatchesHeapWalk)
+{
+    const size_t heap_size = 256 * 1024;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+
+    std::vector<void *> blocks;
+    for (int i = 0; i < 2000; ++i) {
+        void *p = mem_malloc(16 + i % 90);
+        ASSERT_NE(p, nullptr);
+        blocks.push_back(p);
+    }
+    for (size_t i = 0; i < blocks.size(); i += 3) {
+        mem_free(blocks[i]);
+    }
+
+    FILE *file = tmpfile();
+    ASSERT_NE(file, nullptr);
+    ASSERT_EQ(mem_dump_binary(fileno(file)), 0);
+    rewind(file);
+
+    MemSnapshotHeader header;
+    ASSERT_EQ(fread(&header, sizeof(header), 1, file), 1u);
+    EXPECT_EQ(memcmp(header.magic, MEM_SNAPSHOT_MAGIC, sizeof(header.magic)), 0);
+    EXPECT_EQ(header.version, uint32_t(MEM_SNAPSHOT_VERSION));
+    EXPECT_EQ(header.record_size, sizeof(MemSnapshotRecord));
+    EXPECT_LT(header.heap_size, heap_size);
+
+    std::vector<MemSnapshotRecord> records(header.block_count);
+    ASSERT_EQ(fread(records.data(), sizeof(MemSnapshotRecord), records.size(), file), records.size());
+    EXPECT_EQ(fgetc(file), EOF);
+    fclose(file);
+
+    // Записи идут в порядке обхода кучи и описывают те же блоки
+    struct Expected
+    {
+        std::vector<MemBlockInfo> blocks;
+    } expected;
+    mem_heap_walk([](const MemBlockInfo *info, void *ctx) {
+        static_cast<Expected *>(ctx)->blocks.push_back(*info);
+        return true;
+    }, &expected);
+    ASSERT_EQ(records.size(), expected.blocks.size());
+    for (size_t i = 0; i < records.size(); ++i) {
+        auto &info = expected.blocks[i];
+        EXPECT_EQ(records[i].offset - records[0].offset,
+                  uint64_t(static_cast<char *>(info.address) - static_cast<char *>(expected.blocks[0].address))) << i;
+        EXPECT_EQ(records[i].size, info.size);
+        EXPECT_EQ(records[i].state, uint32_t(info.state));
+        EXPECT_EQ(records[i].bin, info.bin == MEM_NO_BIN ? MEM_SNAPSHOT_NO_BIN : info.bin);
+        if (i > 0) {
+            EXPECT_EQ(records[i].offset, records[i - 1].offset + records[i - 1].size + header.block_overhead);
+        }
+    }
+
+    EXPECT_EQ(mem_dump_binary(-1), EINVAL);
+    reset_default_heap();
+}
+
+#if defined(HEAP_ANALYZER_PATH)
+// Запускает анализатор и возвращает его вывод, код возврата кладёт в status
+static std::string run_analyzer(const std::string &path, int *status)
+{
+    std::string output;
+    FILE *pipe = popen((std::string(HEAP_ANALYZER_PATH) + " " + path + " 2>&1").c_str(), "r");
+    if (!pipe) {
+        *status = -1;
+        return output;
+    }
+
+    char buffer[256];
+    while (fgets(buffer, sizeof(buffer), pipe)) {
+        output += buffer;
+    }
+
+    int result = pclose(pipe);
+    *status = WIFEXITED(result) ? WEXITSTATUS(result) : -1;
+    return output;
+}
+
+TEST(SnapshotTest, AnalyzerReadsDumpBack)
+{
+    const size_t heap_size = 256 * 1024;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+
+    std::vector<void *> blocks;
+    for (int i = 0; i < 500; ++i) {
+        blocks.push_back(mem_malloc(32 + i % 200));
+        ASSERT_NE(blocks.back(), nullptr);
+    }
+    for (size_t i = 0; i < blocks.size(); i += 4) {
+        mem_free(blocks[i]);
+    }
+
+    WalkTotals totals;
+    mem_heap_walk(count_blocks, &totals);
+
+    char path[] = "/tmp/heap_snapshot_XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(mem_dump_binary(fd), 0);
+    off_t length = lseek(fd, 0, SEEK_END);
+    reset_default_heap();
+
+    // Анализатор видит те же блоки, что и обход кучи
+    int status = 0;
+    std::string report = run_analyzer(path, &status);
+    EXPECT_EQ(status, 0) << report;
+    char expected[128];
+    snprintf(expected, sizeof(expected), "(%zu allocated, %zu free)", totals.allocated, totals.free);
+    EXPECT_NE(report.find(expected), std::string::npos) << report;
+    EXPECT_NE(report.find("free space map"), std::string::npos) << report;
+
+    // Усечённый снимок отвергается до выделения памяти под записи
+    ASSERT_EQ(ftruncate(fd, length - 1), 0);
+    report = run_analyzer(path, &status);
+    EXPECT_EQ(status, 1) << report;
+    EXPECT_NE(report.find("not a heap snapshot"), std::string::npos) << report;
+
+    // Количество блоков, превышающее файл, тоже
+    ASSERT_EQ(ftruncate(fd, length), 0);
+    uint64_t huge_count = uint64_t(1) << 60;
+    ASSERT_EQ(pwrite(fd, &huge_count, sizeof(huge_count), offsetof(MemSnapshotHeader, block_count)),
+              ssize_t(sizeof(huge_count)));
+    run_analyzer(path, &status);
+    EXPECT_EQ(status, 1);
+
+    close(fd);
+    unlink(path);
+}
+#endif
+
+// ----------------------------------------------------------------------
+// Перераспределение с выравниванием
+// ----------------------------------------------------------------------
+
+static bool is_aligned_to(void *ptr, size_t alignment)
+{
+    return reinterpret_cast<std::uintptr_t>(ptr) % alignment == 0;
+}
+
+static void fill_pattern(void *ptr, size_t size)
+{
+    auto bytes = static_cast<unsigned char *>(ptr);
+    for (size_t i = 0; i < size; ++i) {
+        bytes[i] = static_cast<unsigned char>(i * 7 + 3);
+    }
+}
+
+static bool has_pattern(const void *ptr, size_t size)
+{
+    auto bytes = static_cast<const unsigned char *>(ptr);
+    for (size_t i = 0; i < size; ++i) {
+        if (bytes[i] != static_cast<unsigned char>(i * 7 + 3)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST(ReallocAlignedTest, ResizesInPlaceAndKeepsAlignment)
+{
+    const size_t heap_size = 256 * 1024;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+
+    void *a = mem_malloc_aligned(100, 64);
+    ASSERT_TRUE(is_aligned_to(a, 64));
+    fill_pattern(a, 100);
+
+    // За блоком свободная вершина, он растёт на месте
+    void *b = mem_realloc_aligned(a, 1000, 64);
+    EXPECT_EQ(b, a);
+    EXPECT_TRUE(has_pattern(b, 100));
+    fill_pattern(b, 1000);
+    EXPECT_TRUE(mem_check());
+
+    // Уменьшение отдаёт хвост, следующий блок занимает его
+    void *c = mem_realloc_aligned(b, 200, 64);
+    EXPECT_EQ(c, b);
+    EXPECT_TRUE(has_pattern(c, 200));
+    void *after = mem_malloc(300);
+    EXPECT_LT(static_cast<char *>(after), static_cast<char *>(c) + 1000);
+    EXPECT_TRUE(mem_check());
+
+    // Расти некуда, блок переезжает с тем же выравниванием
+    void *d = mem_realloc_aligned(c, 5000, 64);
+    ASSERT_NE(d, nullptr);
+    EXPECT_NE(d, c);
+    EXPECT_TRUE(is_aligned_to(d, 64));
+    EXPECT_TRUE(has_pattern(d, 200));
+
+    // Более строгое выравнивание тоже требует переезда
+    void *e = mem_realloc_aligned(d, 5000, 4096);
+    ASSERT_NE(e, nullptr);
+    EXPECT_TRUE(is_aligned_to(e, 4096));
+    EXPECT_TRUE(has_pattern(e, 200));
+    EXPECT_TRUE(mem_check());
+
+    EXPECT_EQ(mem_realloc_aligned(e, 100, 48), nullptr);
+    mem_free(e);
+    mem_free(after);
+    EXPECT_TRUE(mem_check());
+    reset_default_heap();
+}
+
+TEST(ReallocAlignedTest, OutOfMemoryKeepsBlock)
+{
+    const size_t heap_size = 256 * 1024;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+
+    void *a = mem_malloc_aligned(100, 64);
+    ASSERT_TRUE(is_aligned_to(a, 64));
+    fill_pattern(a, 100);
+    void *filler = mem_malloc(heap_size - 48 * 1024);
+    ASSERT_NE(filler, nullptr);
+
+    // Обычный блок ещё помещается, а с запасом на выравнивание уже нет
+    void *plain = mem_malloc(2000);
+    EXPECT_NE(plain, nullptr);
+    mem_free(plain);
+    EXPECT_EQ(mem_malloc_aligned(2000, 65536), nullptr);
+
+    // Переезд без выравнивания недопустим, исходный блок остаётся на месте
+    EXPECT_EQ(mem_realloc_aligned(a, 2000, 65536), nullptr);
+    EXPECT_TRUE(has_pattern(a, 100));
+    EXPECT_TRUE(mem_check());
+
+    mem_free(a);
+    mem_free(filler);
+    EXPECT_TRUE(mem_check());
+    reset_default_heap();
+}
+
+TEST(ReallocAlignedTest, PlainReallocCopiesAlignedPayload)
+{
+    void *p = mem_malloc_aligned(64, 256);
+    ASSERT_TRUE(is_aligned_to(p, 256));
+    fill_pattern(p, 64);
+
+    void *q = mem_realloc(p, 4096);
+    ASSERT_NE(q, nullptr);
+    EXPECT_TRUE(has_pattern(q, 64));
+    mem_free(q);
+
+    void *r = mem_realloc_aligned(nullptr, 128, 128);
+    EXPECT_TRUE(is_aligned_to(r, 128));
+    mem_free(r);
+    EXPECT_TRUE(mem_check());
+}
+
+// ----------------------------------------------------------------------
+// Пакетное освобождение
+// ----------------------------------------------------------------------
+
+struct Layout
+{
+    char *base = nullptr;
+    std::vector<std::pair<size_t, size_t>> free_blocks;
+};
+
+static Layout heap_layout()
+{
+    Layout layout;
+    mem_heap_walk([](const MemBlockInfo *info, void *ctx) {
+        auto layout = static_cast<Layout *>(ctx);
+        auto address = static_cast<char *>(info->address);
+        if (!layout->base) {
+            layout->base = address;
+        }
+        if (info->state == MEM_BLOCK_FREE) {
+            layout->free_blocks.emplace_back(address - layout->base, info->size);
+        }
+        return true;
+    }, &layout);
+    return layout;
+}
+
+TEST(FreeBatchTest, CoalescesLikeSingleFrees)
+{
+    const size_t heap_size = 4 * 1024 * 1024;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    std::vector<size_t> freed;
+    std::vector<void *> blocks;
+    Layout expected;
+
+    // Одна и та же последовательность в двух кучах: поштучно и пакетом
+    for (int pass = 0; pass < 2; ++pass) {
+        ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+        blocks.clear();
+        for (int i = 0; i < 3000; ++i) {
+            void *p = i % 5 == 0 ? mem_malloc_aligned(40 + i % 300, 64) : mem_malloc(16 + i % 700);
+            ASSERT_NE(p, nullptr);
+            blocks.push_back(p);
+        }
+        // Заранее освобождённые дыры, через которые сливаются серии
+        for (size_t i = 7; i < blocks.size(); i += 50) {
+            mem_free(blocks[i]);
+        }
+
+        if (freed.empty()) {
+            for (size_t i = 0; i < blocks.size(); ++i) {
+                if (i % 11 != 0 && i % 50 != 7) {
+                    freed.push_back(i);
+                }
+            }
+            // Перемешивание, чтобы пакет не был отсортирован
+            for (size_t i = 0; i < freed.size(); ++i) {
+                std::swap(freed[i], freed[(i * 7919) % freed.size()]);
+            }
+        }
+
+        if (pass == 0) {
+            for (size_t i: freed) {
+                mem_free(blocks[i]);
+            }
+            expected = heap_layout();
+        }
+        else {
+            std::vector<void *> batch{nullptr};
+            for (size_t i: freed) {
+                batch.push_back(blocks[i]);
+            }
+            batch.push_back(blocks[freed.front()]);
+            mem_free_batch(batch.data(), batch.size());
+        }
+        EXPECT_TRUE(mem_check());
+    }
+
+    Layout actual = heap_layout();
+    EXPECT_EQ(actual.free_blocks, expected.free_blocks);
+
+    WalkTotals heap_totals;
+    WalkTotals bin_totals;
+    mem_heap_walk(count_blocks, &heap_totals);
+    EXPECT_EQ(mem_bin_walk(count_blocks, &bin_totals), heap_totals.free);
+    EXPECT_EQ(bin_totals.free_bytes, heap_totals.free_bytes);
+    mem_free_batch(nullptr, 10);
+    reset_default_heap();
+}
+
+// ----------------------------------------------------------------------
+// Тесты для быстрого пути с размером, известным при компиляции
+// ----------------------------------------------------------------------
+
+struct FixedNode
+{
+    explicit FixedNode(int value) : value(value) { ++sLive; }
+    ~FixedNode() { --sLive; }
+    int value;
+    FixedNode *next = nullptr;
+    static inline int sLive = 0;
+};
+
+struct alignas(64) FixedLine
+{
+    char bytes[64];
+};
+
+TEST(FixedAllocTest, CachedBlocksAreReusedWithinClass)
+{
+    reset_default_heap();
+    void *a = mem_malloc_fixed<24>();
+    ASSERT_NE(a, nullptr);
+    EXPECT_TRUE(is_aligned_to_max_align(a));
+    memset(a, 0x11, 32);
+    mem_free_fixed<24>(a);
+    // Размеры 17..32 относятся к одному классу
+    EXPECT_EQ(mem_malloc_fixed<32>(), a);
+    mem_free_fixed<32>(a);
+
+    auto node = mem_new<FixedNode>(42);
+    ASSERT_NE(node, nullptr);
+    EXPECT_EQ(node->value, 42);
+    EXPECT_EQ(FixedNode::sLive, 1);
+    mem_delete(node);
+    EXPECT_EQ(FixedNode::sLive, 0);
+
+    auto line = mem_new<FixedLine>();
+    ASSERT_NE(line, nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(line) % 64, 0u);
+    mem_delete(line);
+
+    void *large = mem_malloc_fixed<4096>();
+    ASSERT_NE(large, nullptr);
+    memset(large, 0x22, 4096);
+    mem_free_fixed<4096>(large);
+
+    // Кэш ограничен по глубине, лишние блоки сразу возвращаются в кучу
+    std::vector<void *> blocks;
+    for (int i = 0; i < MEM_FIXED_CACHE_DEPTH * 2; ++i) {
+        blocks.push_back(mem_malloc_fixed<48>());
+        ASSERT_NE(blocks.back(), nullptr);
+    }
+    for (void *p: blocks) {
+        mem_free_fixed<48>(p);
+    }
+    EXPECT_EQ(gMemFixedCache.counts[(48 - 1) / MEM_FIXED_GRANULE], unsigned(MEM_FIXED_CACHE_DEPTH));
+    EXPECT_TRUE(mem_check());
+
+    WalkTotals before;
+    WalkTotals after;
+    mem_heap_walk(count_blocks, &before);
+    mem_fixed_flush();
+    mem_heap_walk(count_blocks, &after);
+    EXPECT_LT(after.allocated, before.allocated);
+    EXPECT_EQ(gMemFixedCache.counts[(48 - 1) / MEM_FIXED_GRANULE], 0u);
+}
+
+// Оставляет блоки в кэше потока
+static void fill_fixed_cache(std::mutex &lock)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<void *> blocks;
+    for (int i = 0; i < 16; ++i) {
+        blocks.push_back(mem_malloc_fixed<40>());
+        blocks.push_back(mem_malloc_fixed<200>());
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        if (i % 2) {
+            mem_free_fixed<200>(blocks[i]);
+        }
+        else {
+            mem_free_fixed<40>(blocks[i]);
+        }
+    }
+}
+
+static std::mutex gFixedHeapLock;
+
+TEST(FixedAllocTest, ExitingThreadFlushesCache)
+{
+    reset_default_heap();
+    WalkTotals before;
+    mem_heap_walk(count_blocks, &before);
+
+    // Поток сам отдаёт кэш под тем же мьютексом, что и остальные вызовы
+    std::thread explicit_flush([] {
+        fill_fixed_cache(gFixedHeapLock);
+        std::lock_guard<std::mutex> guard(gFixedHeapLock);
+        mem_fixed_flush();
+    });
+    explicit_flush.join();
+
+    WalkTotals after;
+    mem_heap_walk(count_blocks, &after);
+    EXPECT_EQ(after.allocated, before.allocated);
+
+    // Завершающийся поток вызывает установленную функцию сброса
+    mem_fixed_set_exit_flush([] {
+        std::lock_guard<std::mutex> guard(gFixedHeapLock);
+        mem_fixed_flush();
+    });
+    std::thread exit_flush([] {
+        fill_fixed_cache(gFixedHeapLock);
+    });
+    exit_flush.join();
+    mem_fixed_set_exit_flush(nullptr);
+
+    after = WalkTotals();
+    mem_heap_walk(count_blocks, &after);
+    EXPECT_EQ(after.allocated, before.allocated);
+    EXPECT_TRUE(mem_check());
+}
+
+TEST(FixedAllocTest, NewHeapDropsCache)
+{
+    reset_default_heap();
+    void *a = mem_malloc_fixed<64>();
+    ASSERT_NE(a, nullptr);
+    mem_free_fixed<64>(a);
+
+    const size_t heap_size = 1024 * 1024;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+    void *b = mem_malloc_fixed<64>();
+    ASSERT_NE(b, nullptr);
+    EXPECT_NE(b, a);
+    EXPECT_GE(static_cast<char *>(b), heap.get());
+    EXPECT_LT(static_cast<char *>(b), heap.get() + heap_size);
+    mem_free_fixed<64>(b);
+    reset_default_heap();
+}
+
+// ----------------------------------------------------------------------
+// Тесты для подсказок о росте буфера
+// ----------------------------------------------------------------------
+
+// Растит буфер шагами, перемежая их мелкими выделениями, и считает переносы
+static size_t count_growth_moves(void *buffer, std::vector<void *> &small)
+{
+    size_t moves = 0;
+    for (size_t size = 128; size <= 128 * 1024; size += 128) {
+        void *grown = mem_realloc(buffer, size);
+        EXPECT_NE(grown, nullptr);
+        moves += grown != buffer;
+        buffer = grown;
+        static_cast<char *>(buffer)[size - 1] = 1;
+        small.push_back(mem_malloc(24 + size % 200));
+    }
+    small.push_back(buffer);
+    return moves;
+}
+
+TEST(HintTest, HintedBufferGrowsInPlace)
+{
+    const size_t heap_size = 4 * 1024 * 1024;
+    std::unique_ptr<char[]> heap(new char[heap_size]);
+    std::vector<void *> small;
+
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+    EXPECT_GT(count_growth_moves(mem_malloc(64), small), 5u);
+    EXPECT_TRUE(mem_check());
+
+    // Свежая куча: место для роста остаётся на вершине, мелкие блоки идут за ним
+    small.clear();
+    ASSERT_EQ(mem_initialize(heap.get(), heap_size), 0);
+    EXPECT_EQ(count_growth_moves(mem_malloc_hint(64, 128 * 1024), small), 0u);
+    EXPECT_TRUE(mem_check());
+    mem_free_batch(small.data(), small.size());
+
+    // Без подходящей вершины берётся большой свободный блок из корзины, его остаток становится victim
+    void *first = mem_malloc(256 * 1024);
+    void *guard = mem_malloc(64);
+    void *rest = mem_malloc(heap_size - 384 * 1024);
+    ASSERT_NE(rest, nullptr);
+    mem_free(first);
+    void *hinted = mem_malloc_hint(64, 128 * 1024);
+    EXPECT_EQ(hinted, first);
+    void *other = mem_malloc(32);
+    ASSERT_NE(other, nullptr);
+    EXPECT_EQ(mem_realloc(hinted, 8192), hinted);
+    EXPECT_EQ(mem_realloc(hinted, 128 * 1024), hinted);
+    EXPECT_TRUE(mem_check());
+
+    EXPECT_NE(mem_malloc_hint(100, 10), nullptr);
+    (void) guard;
+    reset_default_heap();
+}
+
+TEST(HintTest, HintKeepsKnownZeroMemory)
+{
+    const size_t heap_size = 1024 * 1024;
+    std::vector<unsigned char> heap(heap_size, 0);
+    ASSERT_EQ(mem_initialize(heap.data(), heap_size, MEM_INIT_ZEROED), 0);
+
+    void *hinted = mem_malloc_hint(64, 128 * 1024);
+    ASSERT_NE(hinted, nullptr);
+    void *other = mem_malloc(32);
+    ASSERT_NE(other, nullptr);
+    EXPECT_EQ(mem_realloc(hinted, 8192), hinted);
+
+    // Нетронутая память за местом для роста по-прежнему считается нулевой
+    const size_t marker = heap_size / 2;
+    heap[marker] = 0x5A;
+    auto bytes = static_cast<unsigned char *>(mem_calloc(heap_size / 2, 1));
+    ASSERT_NE(bytes, nullptr);
+    ASSERT_LT(bytes, heap.data() + marker);
+    EXPECT_EQ(heap[marker], 0x5A);
+    heap[marker] = 0;
+
+    mem_free(bytes);
+    mem_free(other);
+    mem_free(hinted);
+    EXPECT_TRUE(mem_check());
+    reset_default_heap();
+}
+
+TEST(HintTest, AlignedCarvesBehindRoomKeepHeapValid)
+{
+    const size_t heap_size = 1024 * 1024;
+    std::unique_ptr<char[]> heap(new char[heap_size + 128]);
+    char *base = heap.get() + (64 - reinterpret_cast<uintptr_t>(heap.get()) % 64);
+
+    // Место для роста отделяется от вершины, выровненный блок режется сразу за ним
+    // при любом положении кучи относительно кэш-линии
+    for (size_t offset = 0; offset < 64; offset += 16) {
+        ASSERT_EQ(mem_initialize(base + offset, heap_size), 0);
+        void *hinted = mem_malloc_hint(100, 1000);
+        void *line = mem_malloc_cacheline(100);
+        ASSERT_NE(hinted, nullptr);
+        ASSERT_NE(line, nullptr);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(line) % 64, 0u);
+        EXPECT_TRUE(mem_check()) << "offset " << offset;
+
+        mem_set_cacheline_threshold(256);
+        void *second = mem_malloc_hint(100, 1000);
+        void *large = mem_malloc(300);
+        mem_set_cacheline_threshold(0);
+        ASSERT_NE(second, nullptr);
+        ASSERT_NE(large, nullptr);
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(large) % 64, 0u);
+        EXPECT_TRUE(mem_check()) << "offset " << offset;
+
+        EXPECT_EQ(mem_realloc(second, 900), second);
+        mem_free(large);
+        mem_free(line);
+        mem_free(second);
+        mem_free(hinted);
+        EXPECT_TRUE(mem_check()) << "offset " << offset;
+    }
+
+    reset_default_heap();
+}
+
+// ----------------------------------------------------------------------
+// Тесты для учёта памяти по тегам
+// ----------------------------------------------------------------------
+
+static MemTagStats tag_stats(unsigned tag)
+{
+    MemTagStats stats{};
+    EXPECT_EQ(mem_tag_stats(tag, &stats), 0);
+    return stats;
+}
+
+TEST(TagTest, CountersFollowEveryOperation)
+{
+    const unsigned cache = 3;
+    const unsigned parser = 7;
+
+    auto a = static_cast<char *>(mem_malloc_tagged(100, cache));
+    auto b = static_cast<char *>(mem_calloc_tagged(10, 30, cache));
+    void *c = mem_malloc_aligned_tagged(200, 256, parser);
+    void *plain = mem_malloc(100);
+    ASSERT_NE(a, nullptr);
+    ASSERT_NE(b, nullptr);
+    ASSERT_NE(c, nullptr);
+    EXPECT_TRUE(is_aligned_to_max_align(a));
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(c) % 256, 0u);
+    for (int i = 0; i < 300; ++i) {
+        ASSERT_EQ(b[i], 0);
+    }
+
+    EXPECT_EQ(tag_stats(cache).live_count, 2u);
+    EXPECT_GE(tag_stats(cache).live_bytes, 400u);
+    EXPECT_EQ(tag_stats(parser).live_count, 1u);
+    EXPECT_GE(tag_stats(parser).live_bytes, 200u);
+
+    // realloc сохраняет тег и данные
+    memset(a, 0x5A, 100);
+    a = static_cast<char *>(mem_realloc(a, 5000));
+    ASSERT_NE(a, nullptr);
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQ(static_cast<unsigned char>(a[i]), 0x5A);
+    }
+    EXPECT_EQ(tag_stats(cache).live_count, 2u);
+    EXPECT_GE(tag_stats(cache).live_bytes, 5300u);
+    c = mem_realloc_aligned(c, 3000, 256);
+    ASSERT_NE(c, nullptr);
+    EXPECT_EQ(tag_stats(parser).live_count, 1u);
+    EXPECT_GE(tag_stats(parser).live_bytes, 3000u);
+
+    mem_free(a);
+    void *batch[] = {b, c, plain};
+    mem_free_batch(batch, 3);
+    EXPECT_EQ(tag_stats(cache).live_count, 0u);
+    EXPECT_EQ(tag_stats(cache).live_bytes, 0u);
+    EXPECT_EQ(tag_stats(parser).live_count, 0u);
+    EXPECT_EQ(tag_stats(parser).live_bytes, 0u);
+    EXPECT_TRUE(mem_check());
+
+    MemTagStats stats{};
+    EXPECT_EQ(mem_tag_stats(MEM_TAG_COUNT, &stats), EINVAL);
+    EXPECT_EQ(mem_malloc_tagged(16, MEM_TAG_COUNT), nullptr);
+}
+
+TEST(TagTest, BatchReleasesDuplicatesOnce)
+{
+    const unsigned images = 9;
+    void *kept = mem_malloc_tagged(64, images);
+    void *a = mem_malloc_tagged(100, images);
+    void *b = mem_malloc_aligned_tagged(300, 128, images);
+    mem_set_mmap_threshold(16 * 1024);
+    void *mapped = mem_malloc_tagged(64 * 1024, images);
+    mem_set_mmap_threshold(0);
+    ASSERT_NE(kept, nullptr);
+    ASSERT_NE(a, nullptr);
+    ASSERT_NE(b, nullptr);
+    ASSERT_NE(mapped, nullptr);
+    size_t kept_bytes = tag_stats(images).live_bytes;
+    ASSERT_EQ(tag_stats(images).live_count, 4u);
+
+    // Повторы в пакете освобождают блок и списывают тег только один раз
+    void *batch[] = {a, mapped, b, a, mapped, b, a};
+    mem_free_batch(batch, sizeof(batch) / sizeof(batch[0]));
+    EXPECT_EQ(tag_stats(images).live_count, 1u);
+    EXPECT_LT(tag_stats(images).live_bytes, kept_bytes);
+    EXPECT_GE(tag_stats(images).live_bytes, 64u);
+    EXPECT_TRUE(mem_check());
+
+    mem_free(kept);
+    EXPECT_EQ(tag_stats(images).live_count, 0u);
+    EXPECT_EQ(tag_stats(images).live_bytes, 0u);
+}
+
+TEST(TagTest, LimitRejectsAllocationsOverBudget)
+{
+    const unsigned network = 5;
+    ASSERT_EQ(mem_tag_set_limit(network, 64 * 1024), 0);
+
+    std::vector<void *> buffers;
+    for (void *p; (p = mem_malloc_tagged(4096, network)) != nullptr;) {
+        buffers.push_back(p);
+        ASSERT_LT(buffers.size(), 64u);
+    }
+    EXPECT_LE(tag_stats(network).live_bytes, 64u * 1024 + buffers.size() * 64);
+    EXPECT_GE(buffers.size(), 14u);
+
+    // Освобождение возвращает бюджет, а realloc внутри него не сбрасывает тег
+    void *last = buffers.back();
+    buffers.pop_back();
+    mem_free(last);
+    void *p = mem_malloc_tagged(1024, network);
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(mem_realloc(p, 1 << 20), nullptr);
+    buffers.push_back(p);
+
+    // Блоки в отдельных отображениях учитываются так же
+    mem_set_mmap_threshold(2048);
+    ASSERT_EQ(mem_tag_set_limit(network, 0), 0);
+    void *mapped = mem_malloc_tagged(100 * 1024, network);
+    ASSERT_NE(mapped, nullptr);
+    memset(mapped, 1, 100 * 1024);
+    mapped = mem_realloc(mapped, 300 * 1024);
+    ASSERT_NE(mapped, nullptr);
+    EXPECT_EQ(static_cast<char *>(mapped)[100 * 1024 - 1], 1);
+    EXPECT_GE(tag_stats(network).live_bytes, 300u * 1024);
+    mem_free(mapped);
+    mem_set_mmap_threshold(0);
+
+    mem_free_batch(buffers.data(), buffers.size());
+    EXPECT_EQ(tag_stats(network).live_count, 0u);
+    EXPECT_EQ(tag_stats(network).live_bytes, 0u);
+    EXPECT_TRUE(mem_check());
+}
+
+TEST(TagTest, LimitCoversWholeBlocks)
+{
+    const unsigned logs = 11;
+    // Не кратен выравниванию, чтобы округление блока было заметно
+    const size_t limit = 31 * 128 + 104;
+    ASSERT_EQ(mem_tag_set_limit(logs, limit), 0);
+
+    // Запрошенные размеры укладываются в лимит, а блоки с префиксом и выравниванием уже нет
+    std::vector<void *> blocks;
+    for (void *p; (p = mem_malloc_tagged(100, logs)) != nullptr;) {
+        blocks.push_back(p);
+        ASSERT_LE(tag_stats(logs).live_bytes, limit);
+        ASSERT_LT(blocks.size(), 64u);
+    }
+
+    // Рост на месте тоже учитывает весь блок: запрос точно до лимита не проходит
+    mem_free(blocks.back());
+    blocks.pop_back();
+    MemTagStats stats = tag_stats(logs);
+    size_t held = stats.live_bytes / stats.live_count;
+    size_t room = limit - stats.live_bytes;
+    // Тег занимает префикс в одно выравнивание перед данными
+    const size_t prefix = 2 * sizeof(void *);
+    EXPECT_EQ(mem_realloc(blocks.back(), held - prefix + room), nullptr);
+    EXPECT_EQ(tag_stats(logs).live_bytes, stats.live_bytes);
+    void *shrunk = mem_realloc(blocks.back(), 40);
+    EXPECT_EQ(shrunk, blocks.back());
+    EXPECT_LE(tag_stats(logs).live_bytes, limit);
+
+    mem_free_batch(blocks.data(), blocks.size());
+    EXPECT_EQ(tag_stats(logs).live_bytes, 0u);
+    ASSERT_EQ(mem_tag_set_limit(logs, 0), 0);
+    EXPECT_TRUE(mem_check());
+}
+
+// ----------------------------------------------------------------------
+// Тесты для кучи, общей для нескольких процессов
+// ----------------------------------------------------------------------
+
+TEST(ShmTest, ChildAllocationIsVisibleToParent)
+{
+    const size_t size = 1024 * 1024;
+    int fd = memfd_create("allocator_shm_test", 0);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(mem_heap_shm_create(fd, size), 0);
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        // Дочерний процесс подключается заново, как сделал бы посторонний процесс
+        bool ok = mem_heap_shm_open(fd) == 0;
+        auto message = static_cast<char *>(ok ? mem_malloc(32) : nullptr);
+        if (message) {
+            strcpy(message, "hello from child");
+            mem_heap_set_root(message);
+        }
+        _exit(message ? 0 : 1);
+    }
+
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+
+    auto message = static_cast<char *>(mem_heap_root());
+    ASSERT_NE(message, nullptr);
+    EXPECT_STREQ(message, "hello from child");
+    EXPECT_TRUE(mem_check());
+    mem_free(message);
+
+    // Чужой сегмент не принимается, текущая куча остаётся прежней
+    int foreign = memfd_create("allocator_shm_foreign", 0);
+    ASSERT_GE(foreign, 0);
+    ASSERT_EQ(ftruncate(foreign, size), 0);
+    EXPECT_EQ(mem_heap_shm_open(foreign), EINVAL);
+    EXPECT_EQ(mem_heap_shm_open(-1), EINVAL);
+    EXPECT_EQ(mem_heap_shm_create(fd, 64), EINVAL);
+    close(foreign);
+
+    mem_heap_close();
+    close(fd);
+    reset_default_heap();
+}
+
+TEST(ShmTest, ConcurrentProcessesKeepHeapConsistent)
+{
+    const size_t size = 4 * 1024 * 1024;
+    const int rounds = 20000;
+    int fd = memfd_create("allocator_shm_stress", 0);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(mem_heap_shm_create(fd, size), 0);
+
+    // Оба процесса одновременно выделяют и освобождают блоки в одной куче
+    auto churn = [&](unsigned seed) {
+        std::vector<void *> live(64, nullptr);
+        for (int i = 0; i < rounds; ++i) {
+            seed = seed * 1103515245 + 12345;
+            void *&slot = live[(seed >> 8) % live.size()];
+            if (slot) {
+                mem_free(slot);
+                slot = nullptr;
+            }
+            else {
+                slot = mem_malloc(16 + (seed >> 16) % 2000);
+                if (slot) {
+                    memset(slot, 0xA5, 16);
+                }
+            }
+        }
+        mem_free_batch(live.data(), live.size());
+    };
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        churn(1);
+        _exit(0);
+    }
+
+    churn(2);
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_TRUE(mem_check());
+
+    // После обоих процессов вся куча снова один свободный блок
+    WalkTotals totals;
+    mem_heap_walk(count_blocks, &totals);
+    EXPECT_EQ(totals.free, 1u);
+
+    mem_heap_close();
+    close(fd);
+    reset_default_heap();
+}
+
+// Дочерний процесс умирает внутри обхода кучи, пока держит её мьютекс
+static bool die_in_walk(const MemBlockInfo *, void *ctx)
+{
+    if (ctx) {
+        // Затираем заголовок перед полезными данными
+        memset(static_cast<char *>(ctx) - sizeof(void *), 0xFF, sizeof(void *));
+    }
+    _exit(0);
+}
+
+static void kill_lock_owner(void *corrupt)
+{
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if (pid == 0) {
+        mem_heap_walk(die_in_walk, corrupt);
+        _exit(1);
+    }
+
+    int status = 0;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(WEXITSTATUS(status), 0);
+}
+
+TEST(ShmTest, DeadOwnerRecoversOnlyConsistentHeap)
+{
+    const size_t size = 1024 * 1024;
+    int fd = memfd_create("allocator_shm_owner", 0);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(mem_heap_shm_create(fd, size), 0);
+
+    void *block = mem_malloc(64);
+    void *next = mem_malloc(64);
+    ASSERT_NE(block, nullptr);
+    ASSERT_NE(next, nullptr);
+
+    // Целая куча проходит проверку, мьютекс снова пригоден
+    kill_lock_owner(nullptr);
+    void *p = mem_malloc(32);
+    EXPECT_NE(p, nullptr);
+    mem_free(p);
+    EXPECT_TRUE(mem_check());
+
+    // Повреждённая куча оставляет мьютекс невосстановимым, все операции отказывают
+    kill_lock_owner(block);
+    EXPECT_EQ(mem_malloc(32), nullptr);
+    EXPECT_EQ(mem_malloc(32), nullptr);
+    EXPECT_EQ(mem_heap_root(), nullptr);
+    EXPECT_FALSE(mem_check());
+    MemTagStats stats;
+    EXPECT_EQ(mem_tag_stats(0, &stats), ENOTRECOVERABLE);
+    mem_free(next);
+
+    mem_heap_close();
+    close(fd);
+    reset_default_heap();
+}
+
 int main(int argc, char **argv)
 {
     std::unique_ptr<char[]> heap(new char[HEAP_SIZE]);
+    gTestHeap = heap.get();
     mem_initialize(heap.get(), HEAP_SIZE);
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
@@ -0,0 +1,240 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2026 Dmitry Adzhiev <dmitry.adjiev@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef FIXED_ALLOC_H
+#define FIXED_ALLOC_H
+
+/* <new> and <utility> are freestanding headers, placement new and std::forward come from them */
+#include <new>
+#include <utility>
+#include "memory.h"
+
+/**
+ * Inline fast path for allocations whose size is known at compile time.
+ * The size class of mem_malloc_fixed<N>() is computed by the compiler and
+ * blocks given back with mem_free_fixed<N>() are kept in a per thread cache
+ * of MEM_FIXED_CACHE_DEPTH blocks per class, so a hit is a pointer pop
+ * inlined into the caller. Misses and sizes above MEM_FIXED_MAX_SIZE go
+ * through mem_malloc() and mem_free().
+ *
+ * Cached blocks stay allocated for the heap, walks and mem_check() see them
+ * as such. The cache is dropped whenever another heap is set up, blocks in
+ * it are then lost to the old heap, so call mem_fixed_flush() on every
+ * thread first when the old heap is going to be reopened.
+ *
+ * The heap has no lock of its own, so a thread which shares it with others
+ * must call mem_fixed_flush() under the same lock as its other mem_*() calls
+ * before it exits, or its cached blocks are leaked. Alternatively
+ * mem_fixed_set_exit_flush() installs a function which every exiting thread
+ * runs, it is expected to take that lock and call mem_fixed_flush().
+ */
+#define MEM_FIXED_GRANULE (2 * sizeof(void *))
+
+#define MEM_FIXED_MAX_SIZE 256
+
+#define MEM_FIXED_CLASSES (MEM_FIXED_MAX_SIZE / MEM_FIXED_GRANULE)
+
+#define MEM_FIXED_CACHE_DEPTH 64
+
+/* Defined in memory.cpp */
+extern size_t gHeapGeneration;
+
+struct MemFixedCache
+{
+    size_t generation;
+    void *heads[MEM_FIXED_CLASSES];
+    unsigned counts[MEM_FIXED_CLASSES];
+};
+
+inline thread_local MemFixedCache gMemFixedCache;
+
+typedef void (*mem_fixed_exit_flush_t)();
+
+/* Run by every exiting thread which has used its cache, nullptr when there is none */
+inline mem_fixed_exit_flush_t gMemFixedExitFlush;
+
+/* Set it before the threads which use the fixed size path are started */
+inline void mem_fixed_set_exit_flush(mem_fixed_exit_flush_t flush)
+{
+    __atomic_store_n(&gMemFixedExitFlush, flush, __ATOMIC_RELEASE);
+}
+
+/**
+ * Runs the exit flush when its thread exits. It lives apart from the cache
+ * so that the hot path keeps reading a trivially destructible thread_local,
+ * and it is only touched when a cache is (re)started, which registers it.
+ */
+struct MemFixedCacheReaper
+{
+    ~MemFixedCacheReaper();
+};
+
+inline thread_local MemFixedCacheReaper gMemFixedCacheReaper;
+
+inline MemFixedCache &mem_fixed_cache()
+{
+    MemFixedCache &cache = gMemFixedCache;
+
+    if (__builtin_expect(cache.generation != gHeapGeneration, 0)) {
+        cache = MemFixedCache{gHeapGeneration, {}, {}};
+        (void) &gMemFixedCacheReaper;
+    }
+
+    return cache;
+}
+
+template<size_t N>
+inline void *mem_malloc_fixed()
+{
+    static_assert(N > 0, "fixed allocations need a size");
+
+    if constexpr (N > MEM_FIXED_MAX_SIZE) {
+        return mem_malloc(N);
+    }
+    else {
+        constexpr size_t index = (N - 1) / MEM_FIXED_GRANULE;
+        MemFixedCache &cache = mem_fixed_cache();
+        void *ptr = cache.heads[index];
+
+        if (__builtin_expect(ptr != nullptr, 1)) {
+            cache.heads[index] = *static_cast<void **>(ptr);
+            --cache.counts[index];
+            return ptr;
+        }
+
+        /* The whole class size, so that a cached block fits any size of its class */
+        return mem_malloc((index + 1) * MEM_FIXED_GRANULE);
+    }
+}
+
+/* ptr must come from mem_malloc_fixed() with a size of the same class */
+template<size_t N>
+inline void mem_free_fixed(void *ptr)
+{
+    static_assert(N > 0, "fixed allocations need a size");
+
+    if constexpr (N > MEM_FIXED_MAX_SIZE) {
+        mem_free(ptr);
+    }
+    else {
+        constexpr size_t index = (N - 1) / MEM_FIXED_GRANULE;
+        MemFixedCache &cache = mem_fixed_cache();
+
+        if (ptr && cache.counts[index] < MEM_FIXED_CACHE_DEPTH) {
+            *static_cast<void **>(ptr) = cache.heads[index];
+            cache.heads[index] = ptr;
+            ++cache.counts[index];
+        }
+        else {
+            mem_free(ptr);
+        }
+    }
+}
+
+/* Gives the blocks cached by the calling thread back to the heap */
+inline void mem_fixed_flush()
+{
+    MemFixedCache &cache = gMemFixedCache;
+
+    /* A cache of an older generation belongs to a heap which is gone or has been replaced */
+    if (cache.generation != gHeapGeneration) {
+        cache = MemFixedCache{};
+        return;
+    }
+
+    for (size_t i = 0; i < MEM_FIXED_CLASSES; ++i) {
+        while (void *ptr = cache.heads[i]) {
+            cache.heads[i] = *static_cast<void **>(ptr);
+            mem_free(ptr);
+        }
+
+        cache.counts[i] = 0;
+    }
+}
+
+inline MemFixedCacheReaper::~MemFixedCacheReaper()
+{
+    mem_fixed_exit_flush_t flush = __atomic_load_n(&gMemFixedExitFlush, __ATOMIC_ACQUIRE);
+
+    if (flush) {
+        flush();
+    }
+}
+
+/* Over-aligned types bypass the cache */
+template<typename T>
+inline void *mem_fixed_alloc_for()
+{
+    if constexpr (alignof(T) > MEM_FIXED_GRANULE) {
+        return mem_malloc_aligned(sizeof(T), alignof(T));
+    }
+    else {
+        return mem_malloc_fixed<sizeof(T)>();
+    }
+}
+
+template<typename T>
+inline void mem_fixed_free_for(void *ptr)
+{
+    if constexpr (alignof(T) > MEM_FIXED_GRANULE) {
+        mem_free(ptr);
+    }
+    else {
+        mem_free_fixed<sizeof(T)>(ptr);
+    }
+}
+
+/* Returns nullptr when the heap is out of memory */
+template<typename T, typename... Args>
+inline T *mem_new(Args &&... args)
+{
+    void *ptr = mem_fixed_alloc_for<T>();
+
+    if (!ptr) {
+        return nullptr;
+    }
+#if defined(__cpp_exceptions)
+    try {
+        return new(ptr) T(std::forward<Args>(args)...);
+    }
+    catch (...) {
+        mem_fixed_free_for<T>(ptr);
+        throw;
+    }
+#else
+    return new(ptr) T(std::forward<Args>(args)...);
+#endif
+}
+
+/* object must come from mem_new() of the same type, not of a derived one */
+template<typename T>
+inline void mem_delete(T *object)
+{
+    if (object) {
+        object->~T();
+        mem_fixed_free_for<T>(object);
+    }
+}
+
+#endif //FIXED_ALLOC_H
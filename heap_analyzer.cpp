@@ -0,0 +1,239 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2026 Dmitry Adzhiev <dmitry.adjiev@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "memory.h"
+
+/*
+ * Offline analyzer for snapshots written by mem_dump_binary(). Prints block
+ * and byte totals, the largest contiguous free range, external
+ * fragmentation, size histograms of allocated and free blocks and a map of
+ * free space across the heap.
+ *
+ *     heap_analyzer heap.snapshot [map columns]
+ */
+
+static constexpr size_t kHistogramBuckets = 48;
+
+static constexpr size_t kMapRows = 16;
+
+/* Map cells from fully used to fully free */
+static const char kMapLevels[] = "@#+-. ";
+
+struct Totals
+{
+    size_t allocated = 0;
+    size_t free = 0;
+    uint64_t allocated_bytes = 0;
+    uint64_t free_bytes = 0;
+    uint64_t largest_free = 0;
+    uint64_t allocated_histogram[kHistogramBuckets] = {};
+    uint64_t free_histogram[kHistogramBuckets] = {};
+};
+
+static size_t log2_bucket(uint64_t size)
+{
+    size_t bucket = 0;
+
+    while (size > 1 && bucket + 1 < kHistogramBuckets) {
+        size >>= 1;
+        ++bucket;
+    }
+
+    return bucket;
+}
+
+static bool load(const char *path, MemSnapshotHeader *header, std::vector<MemSnapshotRecord> *records)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (!file) {
+        perror(path);
+        return false;
+    }
+
+    bool ok = fread(header, sizeof(*header), 1, file) == 1
+        && memcmp(header->magic, MEM_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0
+        && header->version == MEM_SNAPSHOT_VERSION
+        && header->record_size == sizeof(MemSnapshotRecord);
+
+    /* The count comes from the file, it must match the records there before anything is sized by it */
+    long length = ok && fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    ok = length >= long(sizeof(*header))
+        && (uint64_t(length) - sizeof(*header)) % header->record_size == 0
+        && (uint64_t(length) - sizeof(*header)) / header->record_size == header->block_count
+        && fseek(file, sizeof(*header), SEEK_SET) == 0;
+
+    if (ok) {
+        records->resize(header->block_count);
+        ok = fread(records->data(), sizeof(MemSnapshotRecord), records->size(), file) == records->size();
+    }
+
+    if (!ok) {
+        fprintf(stderr, "%s: not a heap snapshot of version %d\n", path, MEM_SNAPSHOT_VERSION);
+    }
+
+    fclose(file);
+    return ok;
+}
+
+static Totals summarize(const MemSnapshotHeader &header, const std::vector<MemSnapshotRecord> &records)
+{
+    Totals totals;
+    uint64_t run = 0;
+    uint64_t run_end = 0;
+
+    for (auto &record: records) {
+        if (record.state == MEM_BLOCK_ALLOCATED) {
+            ++totals.allocated;
+            totals.allocated_bytes += record.size;
+            ++totals.allocated_histogram[log2_bucket(record.size)];
+            run = 0;
+            continue;
+        }
+
+        ++totals.free;
+        totals.free_bytes += record.size;
+        ++totals.free_histogram[log2_bucket(record.size)];
+
+        /* Free neighbours are merged by the allocator, but a snapshot of a damaged heap may still have them */
+        if (run && record.offset == run_end + header.block_overhead) {
+            run += header.block_overhead + record.size;
+        }
+        else {
+            run = record.size;
+        }
+
+        run_end = record.offset + record.size;
+        totals.largest_free = run > totals.largest_free ? run : totals.largest_free;
+    }
+
+    return totals;
+}
+
+static void print_totals(const MemSnapshotHeader &header, const Totals &totals)
+{
+    uint64_t overhead = (totals.allocated + totals.free) * uint64_t(header.block_overhead);
+    double fragmentation = totals.free_bytes ? 100.0 * (1.0 - double(totals.largest_free) / totals.free_bytes) : 0;
+
+    printf("heap size          %14llu bytes\n", (unsigned long long) header.heap_size);
+    printf("blocks             %14zu (%zu allocated, %zu free)\n",
+           totals.allocated + totals.free, totals.allocated, totals.free);
+    printf("allocated          %14llu bytes\n", (unsigned long long) totals.allocated_bytes);
+    printf("free               %14llu bytes\n", (unsigned long long) totals.free_bytes);
+    printf("block overhead     %14llu bytes\n", (unsigned long long) overhead);
+    printf("largest free       %14llu bytes\n", (unsigned long long) totals.largest_free);
+    printf("fragmentation      %14.2f %%\n", fragmentation);
+}
+
+static void print_histograms(const Totals &totals)
+{
+    printf("\n%-24s %14s %14s\n", "size", "allocated", "free");
+
+    for (size_t i = 0; i < kHistogramBuckets; ++i) {
+        if (totals.allocated_histogram[i] || totals.free_histogram[i]) {
+            char range[48];
+            snprintf(range, sizeof(range), "[%llu, %llu)", 1ull << i, 1ull << (i + 1));
+            printf("%-24s %14llu %14llu\n", range,
+                   (unsigned long long) totals.allocated_histogram[i],
+                   (unsigned long long) totals.free_histogram[i]);
+        }
+    }
+}
+
+static void print_free_map(const MemSnapshotHeader &header, const std::vector<MemSnapshotRecord> &records,
+                           size_t columns)
+{
+    size_t cells = columns * kMapRows;
+    uint64_t cell_size = (header.heap_size + cells - 1) / cells;
+    std::vector<uint64_t> free_bytes(cells);
+
+    if (cell_size == 0) {
+        return;
+    }
+
+    for (auto &record: records) {
+        if (record.state == MEM_BLOCK_ALLOCATED) {
+            continue;
+        }
+
+        uint64_t begin = record.offset;
+        uint64_t end = record.offset + record.size;
+
+        while (begin < end) {
+            size_t cell = begin / cell_size;
+            uint64_t cell_end = (cell + 1) * cell_size;
+            uint64_t part = (end < cell_end ? end : cell_end) - begin;
+
+            if (cell < cells) {
+                free_bytes[cell] += part;
+            }
+
+            begin += part;
+        }
+    }
+
+    printf("\nfree space map, %llu bytes per cell, '%c' used to '%c' free\n",
+           (unsigned long long) cell_size, kMapLevels[0], kMapLevels[sizeof(kMapLevels) - 2]);
+
+    for (size_t row = 0; row < kMapRows; ++row) {
+        char line[512];
+        size_t n = 0;
+
+        for (size_t column = 0; column < columns; ++column) {
+            double share = double(free_bytes[row * columns + column]) / cell_size;
+            line[n++] = kMapLevels[size_t(share * (sizeof(kMapLevels) - 2) + 0.5)];
+        }
+
+        line[n] = '\0';
+        printf("%10llx |%s|\n", (unsigned long long) (row * columns * cell_size), line);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s snapshot [map columns]\n", argv[0]);
+        return 2;
+    }
+
+    size_t columns = argc > 2 ? strtoul(argv[2], nullptr, 10) : 64;
+    columns = columns < 1 ? 1 : columns > 500 ? 500 : columns;
+
+    MemSnapshotHeader header;
+    std::vector<MemSnapshotRecord> records;
+
+    if (!load(argv[1], &header, &records)) {
+        return 1;
+    }
+
+    Totals totals = summarize(header, records);
+    print_totals(header, totals);
+    print_histograms(totals);
+    print_free_map(header, records, columns);
+    return 0;
+}
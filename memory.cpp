@@ -22,6 +22,12 @@
  * THE SOFTWARE.
  */
 
+/* Included ahead of memory.h, whose min and max macros clash with the intrinsic headers */
+#if defined(__x86_64__) && __STDC_HOSTED__ && !defined(__OSDEV_DUX_LIBSTDC__)
+#define MEM_HAVE_STREAM_KERNELS 1
+#include <immintrin.h>
+#endif
+
 #include "memory.h"
 
 #if defined(__OSDEV_HAVE_STRING_H__)
@@ -32,23 +38,104 @@
 #include <printf.h>
 #endif
 
+#if defined(__OSDEV_HAVE_EXECINFO_H__)
+#include <execinfo.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__OSDEV_HAVE_MMAN_H__)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__OSDEV_HAVE_PTHREAD_H__)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#if defined(__OSDEV_HAVE_UNISTD_H__)
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#if defined(MEM_LATENCY_STATS)
+#include <time.h>
+#endif
+
 // #define LOG_NDEBUG 1
 #define LOG_TAG "memory"
 #include "logging.h"
 
-struct ListHead
-{
-    ListHead *next = nullptr;
-    ListHead *prev = nullptr;
-};
-
 char *gMemStart{};
 
 char *gMemEnd{};
 
+/* Changes whenever another heap is formatted, opened or dropped, see fixed_alloc.h */
+size_t gHeapGeneration = 1;
+
+/**
+ * Word of a block header or footer. Heaps built with COMPACT_METADATA use
+ * 32-bit words and 32-bit free list offsets, which halves the per block
+ * overhead on 64-bit targets and limits a heap to 4 GiB.
+ */
+#if defined(COMPACT_METADATA)
+typedef uint32_t mem_word_t;
+#else
+typedef size_t mem_word_t;
+#endif
+
+typedef mem_word_t mem_offset_t;
+
+struct ListHead;
+
+/**
+ * Free list link. It is stored as an offset from gMemStart rather than as an
+ * absolute pointer, so a heap image stays valid wherever it is mapped.
+ * Offset 0 is the start service block which is never linked, so it is used
+ * as the null value.
+ */
+struct ListLink
+{
+    mem_offset_t offset = 0;
+
+    ListLink() = default;
+
+    ListLink(ListHead *head)
+    {
+        *this = head;
+    }
+
+    ListLink &operator=(ListHead *head)
+    {
+        offset = head ? static_cast<mem_offset_t>(reinterpret_cast<char *>(head) - gMemStart) : 0;
+        return *this;
+    }
+
+    operator ListHead *() const
+    {
+        return offset ? reinterpret_cast<ListHead *>(gMemStart + offset) : nullptr;
+    }
+
+    ListHead *operator->() const
+    {
+        return *this;
+    }
+};
+
+struct ListHead
+{
+    ListLink next;
+    ListLink prev;
+};
+
 static constexpr const size_t kPointerSize = sizeof(void *);
 
-static constexpr const size_t kHeaderSize = kPointerSize * 2;
+static constexpr const size_t kHeaderSize = sizeof(mem_word_t) * 2;
 
 static constexpr const size_t kFooterSize = kHeaderSize;
 
@@ -58,6 +145,12 @@ static constexpr const size_t kBlockAllocated = 1;
 
 static constexpr const size_t kBlockFree = 0;
 
+/* Allocated block owned by a handle, compaction is allowed to move it */
+static constexpr const size_t kBlockMovable = 2;
+
+/* Allocated block living in its own anonymous mapping outside the heap */
+static constexpr const size_t kBlockMapped = 4;
+
 static constexpr const size_t kBinCount = 256;
 
 static constexpr const size_t kHugeBlockMinSize = 256;
@@ -66,25 +159,129 @@ static constexpr const size_t kHugeBinIndex = kBinCount - 1;
 
 static constexpr const size_t kMaxMessageLen = 256;
 
-#if __SIZEOF_POINTER__ == 8
-static constexpr const size_t kMagicNumber = 0x4455585F4D454D21ULL;
+#if !defined(COMPACT_METADATA) && __SIZEOF_POINTER__ == 8
+static constexpr const mem_word_t kMagicNumber = 0x4455585F4D454D21ULL;
 #else
-static constexpr uint32_t kMagicNumber = 0x44555821U;
+static constexpr const mem_word_t kMagicNumber = 0x44555821U;
 #endif
-static constexpr const size_t kMagicNumberSize = sizeof(size_t);
+static constexpr const size_t kMagicNumberSize = sizeof(mem_word_t);
+
+static constexpr const size_t kMagicNumberOffset = sizeof(mem_word_t);
+
+static constexpr const size_t kAlignment = kPointerSize * 2;
+
+/* Block sizes are multiples of kAlignment, the low bits hold the state */
+static constexpr const size_t kBlockStateMask = kAlignment - 1;
 
-static constexpr const size_t kMagicNumberOffset = sizeof(size_t);
+/* Allocated block whose payload starts with its tag, the only state bit 32 bit targets lack */
+static constexpr const size_t kBlockTagged = kBlockStateMask & 8;
 
-static constexpr const size_t kAlignment = kHeaderSize;
+/* Largest payload a header word can describe */
+static constexpr const size_t kMaxBlockSize = static_cast<mem_word_t>(~kBlockStateMask);
 
-#ifdef BINS_ARE_IN_HEAP
-ListHead **gBinList;
+/* Headers smaller than kAlignment are shifted so that payloads stay aligned */
+static constexpr const size_t kHeaderPadding = kAlignment - kHeaderSize;
+
+static constexpr const size_t kHandleTableMinCapacity = 16;
+
+static constexpr const size_t kHugePageSize = 2 * 1024 * 1024;
+
+static constexpr const size_t kCacheLineSize = 64;
+
+#if __SIZEOF_POINTER__ == 8
+static constexpr const size_t kHeapMagicNumber = 0x4455585F48454150ULL;
 #else
+static constexpr const size_t kHeapMagicNumber = 0x44555848U;
+#endif
+
+static constexpr const size_t kHeapVersion = 1;
+
+/**
+ * Allocator state. It lives in static storage by default and at the beginning
+ * of the region for heaps built with BINS_ARE_IN_HEAP and for file backed
+ * heaps. Everything in here is position independent.
+ */
+struct MemHeapState
+{
+    size_t magic;
+    size_t version;
+    size_t header_size;
+    size_t size;
+    mem_offset_t start;
+    mem_offset_t end;
+    mem_offset_t root;
+    mem_offset_t handles;
+    size_t handle_capacity;
+    size_t handle_free;
+    mem_offset_t check_cursor;
+    /* Payload at or above this offset has never been handed out and is known to be zero */
+    mem_offset_t clean;
+    /* Designated victim, the free remainder of the last split kept out of the bins */
+    mem_offset_t victim;
+    /* Last block from mem_malloc_hint() and the end of the room it may grow into */
+    mem_offset_t hint;
+    mem_offset_t hint_end;
+    ListLink bins[kBinCount];
+    MemTagStats tags[MEM_TAG_COUNT];
+};
+
+/**
+ * Handle table entry. A live entry keeps the offset of its block and the lock
+ * count, a free one has a zero block and keeps the next free handle in locks.
+ */
+struct MemHandle
+{
+    mem_offset_t block;
+    size_t locks;
+};
+
+static MemHeapState gHeapState;
+
+MemHeapState *gHeap = &gHeapState;
+
+ListLink *gBinList = gHeapState.bins;
+
+#if defined(__OSDEV_HAVE_MMAN_H__)
+static void *gHeapMapping{};
+
+static size_t gHeapMappingSize{};
+
+static bool gHeapFileBacked{};
+
+static size_t gMmapThreshold{};
 
-ListHead *gBinList[kBinCount];
+/* Range locked with mlock() for MEM_INIT_LOCK */
+static void *gHeapLocked{};
+
+static size_t gHeapLockedSize{};
+#endif
+
+/**
+ * Shared heaps need the process-shared mutex. MemShmHeader is at the start
+ * of the segment and the heap image follows it.
+ */
+#if defined(__OSDEV_HAVE_MMAN_H__) && defined(__OSDEV_HAVE_PTHREAD_H__)
+#define MEM_HAVE_SHARED_HEAP 1
+
+struct MemShmHeader
+{
+    size_t magic;
+    pthread_mutex_t lock;
+};
 
+/* Header of the shared heap in use, nullptr for a private heap */
+static MemShmHeader *gHeapShm{};
 #endif
 
+/* Huge page size backing the heap, 0 when it is backed by regular pages */
+static size_t gHugePageSize{};
+
+/* Allocations of at least this many bytes own whole cache lines, 0 disables it */
+static size_t gCacheLineThreshold{};
+
+/* Copies and clears of at least this many bytes bypass the cache, 0 disables it */
+static size_t gStreamThreshold = 1024 * 1024;
+
 bool mem_block_check(void *p);
 static void mem_debug_block(void *b, const char *tag);
 
@@ -97,9 +294,14 @@ static size_t *mem_block_size_t_ptr(void *_p)
     return reinterpret_cast<size_t *>(_p);
 }
 
+static mem_word_t *mem_block_word_ptr(void *_p)
+{
+    return reinterpret_cast<mem_word_t *>(_p);
+}
+
 static size_t mem_block_get_size(void *_p)
 {
-    return *mem_block_size_t_ptr(_p) & ~0x01;
+    return *mem_block_word_ptr(_p) & ~kBlockStateMask;
 }
 
 static char *mem_block_char_ptr(void *_p)
@@ -114,7 +316,7 @@ static char *mem_block_user_ptr(void *_p)
 
 static void mem_block_pack(void *_p, size_t _sz, size_t _st)
 {
-    *mem_block_size_t_ptr(_p) = _sz | _st;
+    *mem_block_word_ptr(_p) = static_cast<mem_word_t>(_sz | _st);
 }
 
 static char *mem_block_header(void *_p)
@@ -134,7 +336,7 @@ static char *mem_block_footer(void *_p)
 
 static size_t mem_block_get_alloc(void *p)
 {
-    return (*mem_block_size_t_ptr(p) & 0x01);
+    return (*mem_block_word_ptr(p) & kBlockAllocated);
 }
 
 static bool mem_block_is_allocated(void *p)
@@ -147,18 +349,33 @@ static bool mem_block_is_free(void *p)
     return !mem_block_is_allocated(p);
 }
 
+static bool mem_block_is_movable(void *p)
+{
+    return (*mem_block_word_ptr(mem_block_header(p)) & kBlockMovable) != 0;
+}
+
+static bool mem_block_is_mapped(void *p)
+{
+    return (*mem_block_word_ptr(mem_block_header(p)) & kBlockMapped) != 0;
+}
+
+static bool mem_block_is_tagged(void *p)
+{
+    return (*mem_block_word_ptr(mem_block_header(p)) & kBlockTagged) != 0;
+}
+
 static void mem_block_put_to_header(void *_p, size_t _sz, size_t state)
 {
     auto header = mem_block_header(_p);
     mem_block_pack(header, _sz, state);
-    *mem_block_size_t_ptr(header + kMagicNumberSize) = kMagicNumber;
+    *mem_block_word_ptr(header + kMagicNumberSize) = kMagicNumber;
 }
 
 static void mem_block_put_to_footer(void *_p, size_t _sz, size_t state)
 {
     auto footer = mem_block_footer(_p);
     mem_block_pack(footer, _sz, state);
-    *mem_block_size_t_ptr(footer - kMagicNumberSize) = kMagicNumber;
+    *mem_block_word_ptr(footer + kMagicNumberOffset) = kMagicNumber;
 }
 
 static void *mem_block_next(void *_p)
@@ -187,16 +404,16 @@ static inline size_t mem_block_size_with_overhead(void *ptr)
     return mem_block_size(ptr) + kOverheadSize;
 }
 
-static inline size_t *mem_block_get_magic_from_header(void *ptr)
+static inline mem_word_t *mem_block_get_magic_from_header(void *ptr)
 {
-    return mem_block_size_t_ptr(mem_block_header(ptr) + kMagicNumberSize);
+    return mem_block_word_ptr(mem_block_header(ptr) + kMagicNumberSize);
 }
 
 static inline bool mem_block_check_block(void *ptr)
 {
     if (*mem_block_get_magic_from_header(ptr) == kMagicNumber) {
         if ((reinterpret_cast<size_t>(ptr) % kAlignment) == 0) {
-            if (*mem_block_header(ptr) == *mem_block_footer(ptr)) {
+            if (*mem_block_word_ptr(mem_block_header(ptr)) == *mem_block_word_ptr(mem_block_footer(ptr))) {
                 return true;
             }
             else {
@@ -239,6 +456,7 @@ _Node *free_list_prepend(_Node *head,
                          _Node *block)
 {
     block->next = nullptr;
+    block->prev = nullptr;
 
     if (!head) {
         return block;
@@ -266,7 +484,7 @@ _Node *__free_list_insert_sorted(_Node *head,
     auto cursor = head;
 
     if (cmp(block, cursor)) {
-        return free_list_prepend(cursor, head);
+        return free_list_prepend(cursor, block);
     }
 
     while (cursor->next && !cmp(block, cursor->next)) {
@@ -277,8 +495,8 @@ _Node *__free_list_insert_sorted(_Node *head,
     cursor->next = block;
     block->prev = cursor;
 
-    if (cursor->next) {
-        cursor->next->prev = block;
+    if (block->next) {
+        block->next->prev = block;
     }
 
     return head;
@@ -309,10 +527,10 @@ _Node *bin_insert(_Node *block)
     size_t index = mem_block_size(block);
 
     if (index < kHugeBinIndex) {
-        gBinList[index] = free_list_prepend(gBinList[index], block);
+        gBinList[index] = free_list_prepend<_Node>(gBinList[index], block);
     }
     else {
-        gBinList[kHugeBinIndex] = free_list_insert_sorted_by_size(gBinList[kHugeBinIndex], block);
+        gBinList[kHugeBinIndex] = free_list_insert_sorted_by_size<_Node>(gBinList[kHugeBinIndex], block);
     }
 
     return block;
@@ -331,10 +549,10 @@ static void bin_erase(void *block)
 {
     auto *head = reinterpret_cast<ListHead *>(block);
     size_t index = bin_index_from_size(mem_block_size(block));
-    list_erase(head);
+    auto next = list_erase(head);
 
     if (gBinList[index] == head) {
-        gBinList[index] = head->next;
+        gBinList[index] = next;
     }
 
     head->next = nullptr;
@@ -343,7 +561,7 @@ static void bin_erase(void *block)
 
 static ListHead *bin_find(size_t index, size_t size)
 {
-    auto block = gBinList[index];
+    ListHead *block = gBinList[index];
 
     while (block) {
         if (mem_block_size(block) >= size) {
@@ -359,7 +577,7 @@ static ListHead *bin_find(size_t index, size_t size)
 static ListHead *bin_find_free_block(size_t size)
 {
     size_t index = bin_index_from_size(size);
-    auto block = gBinList[index];
+    ListHead *block = gBinList[index];
 
     if (block) {
         if (index == kHugeBinIndex) {
@@ -396,6 +614,17 @@ static void *mem_block_place(void *block, size_t sz)
     return block;
 }
 
+/**
+ * Keeps the incremental checker cursor on a block boundary when the block it
+ * points to is absorbed by a merge.
+ */
+static void mem_check_cursor_absorb(void *block, void *into)
+{
+    if (gHeap->check_cursor && gMemStart + gHeap->check_cursor == block) {
+        gHeap->check_cursor = mem_block_char_ptr(into) - gMemStart;
+    }
+}
+
 static void *mem_block_merge(void *ptr)
 {
     auto next = mem_block_next(ptr);
@@ -409,6 +638,7 @@ static void *mem_block_merge(void *ptr)
     }
 
     else if (prev_allocated && !next_allocated) {
+        mem_check_cursor_absorb(next, ptr);
         size += mem_block_size(next) + kOverheadSize;
         mem_block_put_to_header(ptr, size, kBlockFree);
         void *footer = mem_block_footer(ptr);
@@ -416,6 +646,7 @@ static void *mem_block_merge(void *ptr)
     }
 
     else if (!prev_allocated && next_allocated) {
+        mem_check_cursor_absorb(ptr, prev);
         void *footer = mem_block_footer(ptr);
         size += mem_block_size(prev) + kOverheadSize;
         mem_block_put_to_header(prev, size, kBlockFree);
@@ -424,6 +655,8 @@ static void *mem_block_merge(void *ptr)
     }
 
     else if (!prev_allocated && !next_allocated) {
+        mem_check_cursor_absorb(ptr, prev);
+        mem_check_cursor_absorb(next, prev);
         void *header = mem_block_header(prev);
         void *footer = mem_block_footer(next);
         size += mem_block_size(prev) +
@@ -450,208 +683,3047 @@ static size_t mem_block_aligned_size(size_t size, size_t alignment = kAlignment)
     return aligned_size;
 }
 
-static void *mem_block_erase_merge(void *block)
+/**
+ * Designated victim related stuff. Like dlmalloc's dv the remainder of the
+ * last split for a small request is kept out of the bins, and small requests
+ * without an exact fit are carved from it, so blocks allocated one after
+ * another end up next to each other. Its list links are always null.
+ */
+
+static void *mem_victim()
 {
-    auto current = mem_block_prev(block);
+    return gHeap->victim ? gMemStart + gHeap->victim : nullptr;
+}
 
-    if (mem_block_is_free(current)) {
-        bin_erase(current);
-    }
+static void mem_victim_set(void *block)
+{
+    gHeap->victim = block ? static_cast<mem_offset_t>(mem_block_char_ptr(block) - gMemStart) : 0;
+}
 
-    current = mem_block_next(block);
+/**
+ * Top chunk related stuff. The free block in front of the end service block
+ * is the top chunk: it is never linked into a bin, requests no bin can serve
+ * are carved from its beginning and the rest stays the top chunk, so fresh
+ * memory is handed out like from a bump allocator. Its list links are
+ * always null.
+ */
 
-    if (mem_block_is_free(current)) {
-        bin_erase(current);
-    }
+static bool mem_block_is_top(void *block)
+{
+    return mem_block_next(block) == mem_block_user_ptr(gMemEnd);
+}
 
-    return mem_block_merge(block);
+static void *mem_top()
+{
+    void *last = mem_block_prev(mem_block_user_ptr(gMemEnd));
+    return mem_block_is_free(last) ? last : nullptr;
 }
 
-void *mem_malloc(size_t size)
+/* Puts a free block which is out of every list where it belongs: into its bin unless it is the top chunk */
+static void mem_block_file(void *block)
 {
-    void *block = nullptr;
+    auto head = mem_block_list_head(block);
 
-    if (gMemStart) {
-        if (size > 0) {
-            size_t aligned_size = mem_block_aligned_size(size);
-            auto memoryBlock = bin_find_free_block(aligned_size);
+    if (!mem_block_is_top(block)) {
+        bin_insert(head);
+    }
+}
 
-            if (memoryBlock) {
-                block = memoryBlock;
-                bin_erase(block);
-                block = mem_block_place(block, aligned_size);
-                auto next = mem_block_next(block);
+/**
+ * Growth room related stuff. The free block right after the last block from
+ * mem_malloc_hint() is its room. While the room is the victim, it serves
+ * other requests only when nothing else fits. While it is the top chunk,
+ * the first request that needs the top chunk splits the room off as the
+ * victim and is carved behind it.
+ */
 
-                if (next < gMemEnd && next > gMemStart && mem_block_is_free(next)) {
-                    auto nextBlock = mem_block_list_head(next);
-                    bin_insert(nextBlock);
-                }
-            }
-        }
-        else {
-            ALOGE("Could not allocate block with size %zu", size);
-#if defined(__OSDEV_HAVE_ERRNO_H__)
-            errno = EINVAL;
-#endif
-        }
-    }
-    else {
-#if defined(__OSDEV_HAVE_ERRNO_H__)
-        errno = EINVAL;
-#endif
-        ALOGE("Not initialized");
+static bool mem_block_follows_hint(void *block)
+{
+    if (!gHeap->hint) {
+        return false;
     }
 
-    return block;
+    void *prev = mem_block_prev(block);
+    return prev == gMemStart + gHeap->hint && mem_block_is_allocated(prev);
 }
 
-static size_t mem_aligned_mem_size(size_t size,
-                                   size_t align)
+static bool mem_victim_is_room()
 {
-    return size
-        + max(sizeof(size_t), alignof(size_t))
-        + align - 1;
+    void *victim = mem_victim();
+    return victim && mem_block_follows_hint(victim);
 }
 
-static void *mem_block_resolve_from_aligned(void *ptr)
+/* Splits the room off the top chunk as the victim when the rest still fits size, returns the top chunk */
+static void *mem_top_skip_room(void *top, size_t size)
 {
-    auto p = ptr;
+    char *room_end = gMemStart + gHeap->hint_end;
 
-    if (!mem_block_check_block(ptr)) {
-        auto offset = *mem_block_get_magic_from_header(ptr);
-        p = mem_block_char_ptr(ptr) - offset;
+    if (room_end <= mem_block_char_ptr(top)) {
+        return top;
     }
 
-    return p;
-}
+    size_t room = room_end - mem_block_char_ptr(top);
+    size_t top_size = mem_block_size(top);
 
-void *mem_malloc_aligned(size_t size, size_t alignment)
-{
-    if (alignment > kAlignment) {
-        size_t size_with_alignment = mem_aligned_mem_size(size, alignment);
-        void *ptr = mem_malloc(size_with_alignment);
+    if (room < kOverheadSize * 2 || top_size < room + kOverheadSize + size) {
+        return top;
+    }
 
-        if (ptr) {
-            auto address = reinterpret_cast<size_t>(ptr);
-            auto aligned_ptr =
-                reinterpret_cast<void *>(alignment
-                    * ((address + sizeof(size_t) /* offset */ + alignment - 1) / alignment));
-            mem_block_size_t_ptr(aligned_ptr)[-1] = mem_block_char_ptr(aligned_ptr) - mem_block_char_ptr(ptr);
-            return aligned_ptr;
-        }
+    mem_block_init(top, room, kBlockFree);
+    void *victim = mem_victim();
+
+    if (victim) {
+        bin_insert(mem_block_list_head(victim));
     }
 
-    return mem_malloc(size);
+    mem_victim_set(mem_block_list_head(top));
+    top = mem_block_next(top);
+    mem_block_init(top, top_size - room - kOverheadSize, kBlockFree);
+    mem_block_list_head(top);
+    return top;
 }
 
-void *mem_calloc(size_t num, size_t size)
+/**
+ * Takes the first fitting free block out of the bins, then tries the victim
+ * and then the top chunk, nullptr when none of them fits. The growth room
+ * of a hinted block is the last resort.
+ */
+static void *mem_block_take_free(size_t size)
 {
-    if (size != 0 && num > SIZE_MAX / size) {
-        return nullptr;
+    void *block = bin_find_free_block(size);
+
+    if (block) {
+        bin_erase(block);
+        return block;
     }
 
-    size_t count = size * num;
-    void *p = mem_malloc(count);
+    block = mem_victim();
+    bool room = mem_victim_is_room();
 
-    if (p != nullptr) {
-#if defined(__OSDEV_HAVE_STRING_H__)
-        memset(p, 0, count);
-#else
-        __builtin_memset(p, 0, count);
-#endif
+    if (block && !room && mem_block_size(block) >= size) {
+        mem_victim_set(nullptr);
+        return block;
     }
 
-    return p;
-}
+    block = mem_top();
 
-void *mem_realloc(void *ptr, size_t new_sz)
-{
-    if (!ptr) {
-        return mem_malloc(new_sz);
+    if (block && mem_block_follows_hint(block)) {
+        block = mem_top_skip_room(block, size);
     }
 
-    void *p = mem_block_resolve_from_aligned(ptr);
-    auto block = mem_malloc(new_sz);
+    if (block && mem_block_size(block) >= size) {
+        return block;
+    }
 
-    if (block && mem_block_check_block(block)) {
-#if defined(__OSDEV_HAVE_STRING_H__) && defined(__OSDEV_HAVE_CONFIG_H__)
-        memmove(block, p, min(new_sz, mem_block_size(p)));
-#else
-        __builtin_memmove(block, p, min(new_sz, mem_block_size(p)));
-#endif
-        mem_free(p);
+    block = mem_victim();
+
+    if (block && room && mem_block_size(block) >= size) {
+        mem_victim_set(nullptr);
+        return block;
     }
 
-    return block;
+    return nullptr;
 }
 
-void mem_free(void *ptr)
+/**
+ * Unlinks the free neighbours of a block and merges them. A merge with the
+ * victim yields the victim, one with the top chunk the top chunk.
+ */
+static void *mem_block_erase_merge(void *block)
 {
-    if (ptr) {
-        void *p = mem_block_resolve_from_aligned(ptr);
+    void *victim = mem_victim();
+    bool absorbs_victim = false;
+    auto current = mem_block_prev(block);
 
-        if (mem_block_check_block(p)) {
-            if (mem_block_is_allocated(p)) {
-                size_t size = mem_block_size(p);
-                mem_block_init(p, size, kBlockFree);
-                p = mem_block_erase_merge(p);
-                bin_insert(mem_block_list_head(p));
-            }
-        }
-        else {
-            ALOGE("%s(): Invalid pointer (%p)\n", __func__, ptr);
-        }
+    if (mem_block_is_free(current)) {
+        absorbs_victim |= current == victim;
+        bin_erase(current);
     }
-}
 
-int mem_initialize(void *base, size_t size)
-{
-    if (base && size > 0 && (size % 2 == 0)) {
-        size_t binsSize = kBinCount * sizeof(void *);
+    current = mem_block_next(block);
 
-        if (size > binsSize) {
-            gMemStart = mem_block_char_ptr(base);
-#if BINS_ARE_IN_HEAP
-            gMemStart = mem_block_char_ptr(base) + binsSize;
-            size -= binsSize;
-            gBinList = reinterpret_cast<ListHead **>(base);
-            ALOGD("gBinList %p binsSize %zu gMemStart %p", gBinList, binsSize, gMemStart);
-#endif
-#if defined(__OSDEV_HAVE_STRING_H__)
-            memset(gBinList, 0, binsSize);
-#else
-            __builtin_memset(gBinList, 0, binsSize);
-#endif
-            mem_block_init(mem_block_char_ptr(gMemStart) + kHeaderSize, kOverheadSize, kBlockAllocated);
-            size_t heapSize = size - (kOverheadSize * 5);
-            void *heap = mem_block_next(mem_block_user_ptr(gMemStart));
-            mem_block_init(heap, heapSize, kBlockFree);
-            gMemEnd = mem_block_char_ptr(mem_block_next(heap)) - kHeaderSize;
-            mem_block_init(mem_block_char_ptr(gMemEnd) + kHeaderSize, kOverheadSize, kBlockAllocated);
-            auto firstBlock = mem_block_list_head(heap);
-            bin_insert(firstBlock);
-            return 0;
-        }
-    }
-    else {
-        ALOGE("Could not initialize memory with params base %p size %zu", base, size);
+    if (mem_block_is_free(current)) {
+        absorbs_victim |= current == victim;
+        bin_erase(current);
     }
 
-    ALOGD("gMemStart %p gMemEnd %p size %td",
-          gMemStart,
-          gMemEnd,
-          mem_block_char_ptr(gMemEnd) - mem_block_char_ptr(gMemStart));
+    block = mem_block_merge(block);
 
-    return EINVAL;
+    /* A victim merged into the top chunk stops being the victim */
+    if (absorbs_victim) {
+        mem_victim_set(mem_block_is_top(block) ? nullptr : block);
+    }
+
+    return block;
 }
 
-void mem_unuinitialize()
+/**
+ * Sampling heap profiler. About every gProfilePeriod allocated bytes, with
+ * the distance between samples drawn from an exponential distribution, the
+ * allocation's stack is recorded. Samples live in fixed tables outside the
+ * heap so the profiler never allocates: stacks are aggregated into buckets
+ * holding live and cumulative totals, and live samples are keyed by block.
+ */
+
+#if defined(__OSDEV_HAVE_EXECINFO_H__)
+static constexpr size_t kProfileMaxFrames = 24;
+
+static constexpr size_t kProfileBucketCount = 2048;
+
+static constexpr size_t kProfileSampleCount = 16384;
+
+struct MemProfileBucket
 {
-    gMemStart = nullptr;
-    gMemEnd = nullptr;
-}
+    uint64_t hash;
+    size_t depth;
+    void *frames[kProfileMaxFrames];
+    size_t alloc_count;
+    size_t alloc_bytes;
+    size_t live_count;
+    size_t live_bytes;
+};
 
-void dump_mem()
+struct MemProfileSample
+{
+    void *block;
+    size_t bucket;
+    size_t size;
+};
+
+static MemProfileBucket gProfileBuckets[kProfileBucketCount];
+
+static MemProfileSample gProfileSamples[kProfileSampleCount];
+
+/* Mean distance between samples in bytes, kept after mem_profile_stop() for the dump header */
+static size_t gProfilePeriod{};
+
+static bool gProfileSampling{};
+
+static size_t gProfileUntilSample{};
+
+static uint64_t gProfileRandom = 0x9E3779B97F4A7C15ull;
+
+/* Samples lost because one of the tables was full */
+static size_t gProfileDropped{};
+
+/* Occupied entries of gProfileSamples, one is always left empty to end the probes */
+static size_t gProfileSampleCount{};
+
+static uint64_t mem_profile_hash(uint64_t hash, uint64_t value)
+{
+    hash ^= value + 0x9E3779B97F4A7C15ull + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+static size_t mem_profile_next_distance()
+{
+    gProfileRandom ^= gProfileRandom << 13;
+    gProfileRandom ^= gProfileRandom >> 7;
+    gProfileRandom ^= gProfileRandom << 17;
+    /* Uniform in (0, 1] from the top 53 bits */
+    double uniform = static_cast<double>((gProfileRandom >> 11) + 1) / 9007199254740992.0;
+    return static_cast<size_t>(-__builtin_log(uniform) * static_cast<double>(gProfilePeriod)) + 1;
+}
+
+static size_t mem_profile_sample_slot(void *block)
+{
+    return (reinterpret_cast<uintptr_t>(block) / kAlignment) % kProfileSampleCount;
+}
+
+static MemProfileBucket *mem_profile_bucket(void **frames, size_t depth)
+{
+    uint64_t hash = depth;
+
+    for (size_t i = 0; i < depth; ++i) {
+        hash = mem_profile_hash(hash, reinterpret_cast<uintptr_t>(frames[i]));
+    }
+
+    for (size_t probe = 0; probe < kProfileBucketCount; ++probe) {
+        auto bucket = &gProfileBuckets[(hash + probe) % kProfileBucketCount];
+
+        if (bucket->depth == 0) {
+            bucket->hash = hash;
+            bucket->depth = depth;
+            __builtin_memcpy(bucket->frames, frames, depth * sizeof(void *));
+            return bucket;
+        }
+
+        if (bucket->hash == hash && bucket->depth == depth
+            && __builtin_memcmp(bucket->frames, frames, depth * sizeof(void *)) == 0) {
+            return bucket;
+        }
+    }
+
+    return nullptr;
+}
+
+__attribute__((noinline))
+static void mem_profile_record(void *block, size_t size)
+{
+    void *frames[kProfileMaxFrames + 1];
+    /* Drop this function from the stack */
+    int depth = backtrace(frames, kProfileMaxFrames + 1) - 1;
+    MemProfileBucket *bucket = depth > 0 ? mem_profile_bucket(frames + 1, depth) : nullptr;
+
+    if (!bucket) {
+        ++gProfileDropped;
+        return;
+    }
+
+    bucket->alloc_count++;
+    bucket->alloc_bytes += size;
+
+    if (gProfileSampleCount + 1 == kProfileSampleCount) {
+        ++gProfileDropped;
+        return;
+    }
+
+    size_t slot = mem_profile_sample_slot(block);
+
+    while (gProfileSamples[slot].block) {
+        slot = (slot + 1) % kProfileSampleCount;
+    }
+
+    gProfileSamples[slot] = MemProfileSample{block, static_cast<size_t>(bucket - gProfileBuckets), size};
+    gProfileSampleCount++;
+    bucket->live_count++;
+    bucket->live_bytes += size;
+}
+
+/* Called for every allocated block, the common case is a single subtraction */
+static inline void mem_profile_alloc(void *block, size_t size)
+{
+    if (gProfileSampling && block) {
+        if (gProfileUntilSample > size) {
+            gProfileUntilSample -= size;
+        }
+        else {
+            gProfileUntilSample = mem_profile_next_distance();
+            mem_profile_record(block, size);
+        }
+    }
+}
+
+/**
+ * Forgets the live sample of a block if there is one, also once sampling is
+ * stopped so the live totals stay right. The table uses linear probing,
+ * entries after the removed one are shifted back to keep every probe
+ * sequence unbroken.
+ */
+static void mem_profile_free(void *block)
+{
+    if (!gProfileSampleCount) {
+        return;
+    }
+
+    size_t slot = mem_profile_sample_slot(block);
+
+    while (gProfileSamples[slot].block != block) {
+        if (!gProfileSamples[slot].block) {
+            return;
+        }
+
+        slot = (slot + 1) % kProfileSampleCount;
+    }
+
+    auto bucket = &gProfileBuckets[gProfileSamples[slot].bucket];
+    gProfileSampleCount--;
+    bucket->live_count--;
+    bucket->live_bytes -= gProfileSamples[slot].size;
+
+    for (size_t next = (slot + 1) % kProfileSampleCount; gProfileSamples[next].block;
+         next = (next + 1) % kProfileSampleCount) {
+        size_t home = mem_profile_sample_slot(gProfileSamples[next].block);
+
+        /* The entry may move into the hole only if the hole is between its home slot and itself */
+        if ((next > slot && (home <= slot || home > next)) || (next < slot && home <= slot && home > next)) {
+            gProfileSamples[slot] = gProfileSamples[next];
+            slot = next;
+        }
+    }
+
+    gProfileSamples[slot] = MemProfileSample{};
+}
+
+/* Live samples refer to blocks of the current heap, a new heap starts without them */
+static void mem_profile_drop_live()
+{
+    for (auto &sample: gProfileSamples) {
+        sample = MemProfileSample{};
+    }
+
+    gProfileSampleCount = 0;
+
+    for (auto &bucket: gProfileBuckets) {
+        bucket.live_count = 0;
+        bucket.live_bytes = 0;
+    }
+}
+
+int mem_profile_start(size_t sample_period)
+{
+    if (sample_period == 0) {
+        ALOGE("Could not start profiler with sample period 0");
+        return EINVAL;
+    }
+
+    for (auto &bucket: gProfileBuckets) {
+        bucket = MemProfileBucket{};
+    }
+
+    mem_profile_drop_live();
+    gProfileDropped = 0;
+    gProfilePeriod = sample_period;
+    gProfileUntilSample = mem_profile_next_distance();
+    gProfileSampling = true;
+    return 0;
+}
+
+void mem_profile_stop()
+{
+    gProfileSampling = false;
+}
+
+/**
+ * Writes the samples collected since mem_profile_start() in the legacy text
+ * heap profile format understood by pprof. Every record holds live objects
+ * and bytes followed by the cumulative ones in brackets. The counts are the
+ * raw sampled values, pprof scales them using the period in the header.
+ */
+int mem_profile_dump(int fd)
+{
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+
+    for (auto &bucket: gProfileBuckets) {
+        live_count += bucket.live_count;
+        live_bytes += bucket.live_bytes;
+        alloc_count += bucket.alloc_count;
+        alloc_bytes += bucket.alloc_bytes;
+    }
+
+    if (dprintf(fd, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                live_count, live_bytes, alloc_count, alloc_bytes, gProfilePeriod) < 0) {
+        return EINVAL;
+    }
+
+    for (auto &bucket: gProfileBuckets) {
+        if (bucket.depth == 0) {
+            continue;
+        }
+
+        dprintf(fd, "%zu: %zu [%zu: %zu] @", bucket.live_count, bucket.live_bytes,
+                bucket.alloc_count, bucket.alloc_bytes);
+
+        for (size_t i = 0; i < bucket.depth; ++i) {
+            dprintf(fd, " %p", bucket.frames[i]);
+        }
+
+        dprintf(fd, "\n");
+    }
+
+    /* pprof needs the mappings to symbolize the addresses */
+    dprintf(fd, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+
+    if (maps >= 0) {
+        char buffer[4096];
+
+        for (ssize_t n = read(maps, buffer, sizeof(buffer)); n > 0; n = read(maps, buffer, sizeof(buffer))) {
+            if (write(fd, buffer, n) != n) {
+                break;
+            }
+        }
+
+        close(maps);
+    }
+
+    if (gProfileDropped) {
+        ALOGE("Heap profile lost %zu samples", gProfileDropped);
+    }
+
+    return 0;
+}
+#else
+static inline void mem_profile_alloc(void *, size_t)
+{
+}
+
+static inline void mem_profile_free(void *)
+{
+}
+
+static inline void mem_profile_drop_live()
+{
+}
+#endif
+
+/**
+ * Latency histograms. Each public operation is timed with the time stamp
+ * counter on x86-64 and CLOCK_MONOTONIC elsewhere, only the outermost one
+ * when they nest, so mem_realloc() is not counted as a mem_malloc() too.
+ * Counters are bumped with relaxed atomics, snapshots may be taken from any
+ * thread. Without MEM_LATENCY_STATS the scopes compile to nothing.
+ */
+
+#if defined(MEM_LATENCY_STATS)
+static uint64_t gLatencyCounts[MEM_LATENCY_OP_COUNT][MEM_LATENCY_SIZE_CLASSES][MEM_LATENCY_BUCKETS];
+
+/* Both clocks read at the first operation, to convert ticks to seconds */
+static uint64_t gLatencyEpochTicks;
+
+static uint64_t gLatencyEpochNs;
+
+static thread_local unsigned gLatencyDepth;
+
+static uint64_t mem_latency_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t mem_latency_ticks()
+{
+#if defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    return mem_latency_ns();
+#endif
+}
+
+static size_t mem_latency_size_class(size_t size)
+{
+    if (size <= 64) {
+        return 0;
+    }
+
+    size_t bits = sizeof(size_t) * 8 - __builtin_clzl(size - 1);
+    return min((bits - 5) / 2, size_t(MEM_LATENCY_SIZE_CLASSES - 1));
+}
+
+static size_t mem_latency_bucket(uint64_t ticks)
+{
+    if (ticks == 0) {
+        return 0;
+    }
+
+    return min(size_t(63 - __builtin_clzll(ticks)), size_t(MEM_LATENCY_BUCKETS - 1));
+}
+
+struct MemLatencyScope
+{
+    MemLatencyScope(MemLatencyOp op, size_t size)
+        : op(op), size(size), start(++gLatencyDepth == 1 ? mem_latency_ticks() : 0)
+    {
+    }
+
+    ~MemLatencyScope()
+    {
+        if (--gLatencyDepth == 0) {
+            uint64_t ticks = mem_latency_ticks() - start;
+            uint64_t *count = &gLatencyCounts[op][mem_latency_size_class(size)][mem_latency_bucket(ticks)];
+            __atomic_fetch_add(count, 1, __ATOMIC_RELAXED);
+
+            if (__atomic_load_n(&gLatencyEpochNs, __ATOMIC_RELAXED) == 0) {
+                __atomic_store_n(&gLatencyEpochTicks, mem_latency_ticks(), __ATOMIC_RELAXED);
+                __atomic_store_n(&gLatencyEpochNs, mem_latency_ns(), __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    MemLatencyOp op;
+    size_t size;
+    uint64_t start;
+};
+
+#define MEM_LATENCY_SCOPE(op, size) MemLatencyScope latencyScope(op, size)
+
+void mem_latency_snapshot(MemLatencyStats *stats)
+{
+    if (!stats) {
+        return;
+    }
+
+    uint64_t *counts = &stats->counts[0][0][0];
+    const uint64_t *source = &gLatencyCounts[0][0][0];
+
+    for (size_t i = 0; i < sizeof(gLatencyCounts) / sizeof(uint64_t); ++i) {
+        counts[i] = __atomic_load_n(&source[i], __ATOMIC_RELAXED);
+    }
+
+#if defined(__x86_64__)
+    uint64_t epochNs = __atomic_load_n(&gLatencyEpochNs, __ATOMIC_RELAXED);
+    uint64_t epochTicks = __atomic_load_n(&gLatencyEpochTicks, __ATOMIC_RELAXED);
+    uint64_t ticks = mem_latency_ticks();
+    uint64_t ns = mem_latency_ns();
+    /* The rate is only known once some time has passed since the first operation */
+    stats->ticks_per_second = epochNs && ns > epochNs
+        ? uint64_t(double(ticks - epochTicks) * 1e9 / double(ns - epochNs)) : 0;
+#else
+    stats->ticks_per_second = 1000000000;
+#endif
+}
+
+void mem_latency_reset()
+{
+    uint64_t *counts = &gLatencyCounts[0][0][0];
+
+    for (size_t i = 0; i < sizeof(gLatencyCounts) / sizeof(uint64_t); ++i) {
+        __atomic_store_n(&counts[i], 0, __ATOMIC_RELAXED);
+    }
+}
+#else
+#define MEM_LATENCY_SCOPE(op, size) do {} while (0)
+#endif
+
+/**
+ * Shared heap lock. Public entry points hold the mutex of a shared heap for
+ * their whole duration, and nested calls do not take it again. A mutex left
+ * by a process which died holding it is made consistent again once the heap
+ * has been verified. A corrupted heap leaves it unrecoverable instead, so
+ * every later operation on it fails. MEM_SHM_SCOPE() returns its arguments
+ * from the calling function when the lock could not be taken.
+ */
+
+#if defined(MEM_HAVE_SHARED_HEAP)
+static thread_local unsigned gShmLockDepth;
+
+/* Returns 0 once the lock is held */
+static int mem_shm_lock(MemShmHeader *shm)
+{
+    int result = pthread_mutex_lock(&shm->lock);
+
+    if (result == EOWNERDEAD) {
+        if (!mem_check()) {
+            ALOGE("Shared heap is corrupted, its lock owner died in the middle of an operation");
+            /* Unlocking without marking the mutex consistent makes it unrecoverable for everyone */
+            pthread_mutex_unlock(&shm->lock);
+            return ENOTRECOVERABLE;
+        }
+
+        pthread_mutex_consistent(&shm->lock);
+        result = 0;
+    }
+    else if (result != 0) {
+        ALOGE("Could not lock shared heap, error %d", result);
+    }
+
+    return result;
+}
+
+struct MemShmScope
+{
+    MemShmScope()
+        : shm(gHeapShm), error(0)
+    {
+        if (shm && gShmLockDepth++ == 0) {
+            error = mem_shm_lock(shm);
+
+            if (error) {
+                gShmLockDepth = 0;
+                shm = nullptr;
+            }
+        }
+    }
+
+    ~MemShmScope()
+    {
+        if (shm && --gShmLockDepth == 0) {
+            pthread_mutex_unlock(&shm->lock);
+        }
+    }
+
+    MemShmHeader *shm;
+    int error;
+};
+
+#define MEM_SHM_SCOPE(...) MemShmScope shmScope; if (shmScope.error) return __VA_ARGS__
+#else
+#define MEM_SHM_SCOPE(...) do {} while (0)
+#endif
+
+/**
+ * Copy and clear kernels. Short ranges go to the compiler builtins, long ones
+ * are written with non-temporal stores so that moving or zeroing a large
+ * block does not evict everything else from the cache. The widest vector
+ * path is picked at runtime, builds without x86-64 or a hosted runtime only
+ * get the builtins.
+ */
+
+#if defined(MEM_HAVE_STREAM_KERNELS)
+enum MemStreamIsa
+{
+    MEM_STREAM_UNKNOWN,
+    MEM_STREAM_SSE2,
+    MEM_STREAM_AVX2,
+    MEM_STREAM_AVX512
+};
+
+static MemStreamIsa gStreamIsa = MEM_STREAM_UNKNOWN;
+
+static MemStreamIsa mem_stream_isa()
+{
+    if (gStreamIsa == MEM_STREAM_UNKNOWN) {
+        /* Allocations may happen before the constructors which initialize cpu features */
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx512f")) {
+            gStreamIsa = MEM_STREAM_AVX512;
+        }
+        else if (__builtin_cpu_supports("avx2")) {
+            gStreamIsa = MEM_STREAM_AVX2;
+        }
+        else {
+            gStreamIsa = MEM_STREAM_SSE2;
+        }
+    }
+
+    return gStreamIsa;
+}
+
+/**
+ * Each kernel stores whole vectors to an aligned destination and returns the
+ * number of bytes it has handled, the caller finishes the tail.
+ */
+static size_t mem_stream_copy_sse2(char *dst, const char *src, size_t size)
+{
+    size_t done = 0;
+
+    for (; done + 64 <= size; done += 64) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + done));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + done + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + done + 32));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + done + 48));
+        _mm_stream_si128(reinterpret_cast<__m128i *>(dst + done), a);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(dst + done + 16), b);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(dst + done + 32), c);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(dst + done + 48), d);
+    }
+
+    return done;
+}
+
+__attribute__((target("avx2")))
+static size_t mem_stream_copy_avx2(char *dst, const char *src, size_t size)
+{
+    size_t done = 0;
+
+    for (; done + 128 <= size; done += 128) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + done));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + done + 32));
+        __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + done + 64));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + done + 96));
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(dst + done), a);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(dst + done + 32), b);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(dst + done + 64), c);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(dst + done + 96), d);
+    }
+
+    return done;
+}
+
+__attribute__((target("avx512f")))
+static size_t mem_stream_copy_avx512(char *dst, const char *src, size_t size)
+{
+    size_t done = 0;
+
+    for (; done + 256 <= size; done += 256) {
+        __m512i a = _mm512_loadu_si512(src + done);
+        __m512i b = _mm512_loadu_si512(src + done + 64);
+        __m512i c = _mm512_loadu_si512(src + done + 128);
+        __m512i d = _mm512_loadu_si512(src + done + 192);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + done), a);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + done + 64), b);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + done + 128), c);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + done + 192), d);
+    }
+
+    return done;
+}
+
+static size_t mem_stream_zero_sse2(char *dst, size_t size)
+{
+    size_t done = 0;
+    __m128i zero = _mm_setzero_si128();
+
+    for (; done + 64 <= size; done += 64) {
+        _mm_stream_si128(reinterpret_cast<__m128i *>(dst + done), zero);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(dst + done + 16), zero);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(dst + done + 32), zero);
+        _mm_stream_si128(reinterpret_cast<__m128i *>(dst + done + 48), zero);
+    }
+
+    return done;
+}
+
+__attribute__((target("avx2")))
+static size_t mem_stream_zero_avx2(char *dst, size_t size)
+{
+    size_t done = 0;
+    __m256i zero = _mm256_setzero_si256();
+
+    for (; done + 128 <= size; done += 128) {
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(dst + done), zero);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(dst + done + 32), zero);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(dst + done + 64), zero);
+        _mm256_stream_si256(reinterpret_cast<__m256i *>(dst + done + 96), zero);
+    }
+
+    return done;
+}
+
+__attribute__((target("avx512f")))
+static size_t mem_stream_zero_avx512(char *dst, size_t size)
+{
+    size_t done = 0;
+    __m512i zero = _mm512_setzero_si512();
+
+    for (; done + 256 <= size; done += 256) {
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + done), zero);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + done + 64), zero);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + done + 128), zero);
+        _mm512_stream_si512(reinterpret_cast<__m512i *>(dst + done + 192), zero);
+    }
+
+    return done;
+}
+
+/* Bytes to copy with regular stores so that dst becomes aligned for the widest kernel */
+static size_t mem_stream_head(const char *dst)
+{
+    return (64 - reinterpret_cast<uintptr_t>(dst) % 64) % 64;
+}
+
+static bool mem_stream_wanted(size_t size)
+{
+    return gStreamThreshold != 0 && size >= gStreamThreshold;
+}
+#endif
+
+/**
+ * memmove() replacement for the allocator. Overlapping ranges are only
+ * streamed when dst is below src, which is what compaction does, since the
+ * kernels copy forward.
+ */
+static void mem_move(void *dst, const void *src, size_t size)
+{
+#if defined(MEM_HAVE_STREAM_KERNELS)
+    auto d = static_cast<char *>(dst);
+    auto s = static_cast<const char *>(src);
+
+    if (mem_stream_wanted(size) && (d < s || d >= s + size)) {
+        size_t head = min(mem_stream_head(d), size);
+        size_t done;
+        /* A short head may still overlap the source, so it is moved as well */
+        __builtin_memmove(d, s, head);
+
+        switch (mem_stream_isa()) {
+            case MEM_STREAM_AVX512:
+                done = mem_stream_copy_avx512(d + head, s + head, size - head);
+                break;
+
+            case MEM_STREAM_AVX2:
+                done = mem_stream_copy_avx2(d + head, s + head, size - head);
+                break;
+
+            default:
+                done = mem_stream_copy_sse2(d + head, s + head, size - head);
+                break;
+        }
+
+        _mm_sfence();
+        __builtin_memmove(d + head + done, s + head + done, size - head - done);
+        return;
+    }
+#endif
+
+#if defined(__OSDEV_HAVE_STRING_H__) && defined(__OSDEV_HAVE_CONFIG_H__)
+    memmove(dst, src, size);
+#else
+    __builtin_memmove(dst, src, size);
+#endif
+}
+
+/* memset(dst, 0, size) replacement for the allocator */
+static void mem_zero(void *dst, size_t size)
+{
+#if defined(MEM_HAVE_STREAM_KERNELS)
+    auto d = static_cast<char *>(dst);
+
+    if (mem_stream_wanted(size)) {
+        size_t head = min(mem_stream_head(d), size);
+        size_t done;
+        __builtin_memset(d, 0, head);
+
+        switch (mem_stream_isa()) {
+            case MEM_STREAM_AVX512:
+                done = mem_stream_zero_avx512(d + head, size - head);
+                break;
+
+            case MEM_STREAM_AVX2:
+                done = mem_stream_zero_avx2(d + head, size - head);
+                break;
+
+            default:
+                done = mem_stream_zero_sse2(d + head, size - head);
+                break;
+        }
+
+        _mm_sfence();
+        __builtin_memset(d + head + done, 0, size - head - done);
+        return;
+    }
+#endif
+
+#if defined(__OSDEV_HAVE_STRING_H__)
+    memset(dst, 0, size);
+#else
+    __builtin_memset(dst, 0, size);
+#endif
+}
+
+void mem_set_stream_threshold(size_t threshold)
+{
+    gStreamThreshold = threshold;
+}
+
+/**
+ * Mapped block related stuff. A mapped block is a regular allocated block
+ * preceded by a kMappedPrefixSize prefix holding the length of its mapping,
+ * so the usual pointer checks work for it as well.
+ */
+
+#if defined(__OSDEV_HAVE_MMAN_H__)
+/**
+ * A mapping starts with its length, the block header follows at the end of
+ * the first cache line, so mapped payloads are cache line aligned just like
+ * the ones which are carved from the heap for cache line requests.
+ */
+static constexpr size_t kMappedPrefixSize = kCacheLineSize;
+
+static_assert(kMappedPrefixSize >= sizeof(size_t) + kHeaderSize, "mapped prefix holds the length and the header");
+
+static size_t mem_page_size()
+{
+    static size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return page_size;
+}
+
+/* Returns 0 when the payload would not fit a header word */
+static size_t mem_mapped_length(size_t size)
+{
+    size_t page_size = mem_page_size();
+
+    if (size > kMaxBlockSize - page_size) {
+        return 0;
+    }
+
+    size = (size + kBlockStateMask) & ~kBlockStateMask;
+    return page_size * ((kMappedPrefixSize + size + kFooterSize + page_size - 1) / page_size);
+}
+
+/* Payload size of the block which mem_mapped_alloc() maps for size bytes */
+static size_t mem_mapped_block_size(size_t size)
+{
+    size_t length = mem_mapped_length(size);
+    return length ? (length - kMappedPrefixSize - kFooterSize) & ~kBlockStateMask : SIZE_MAX;
+}
+
+static char *mem_mapped_base(void *block)
+{
+    return mem_block_char_ptr(block) - kMappedPrefixSize;
+}
+
+static void *mem_mapped_init(void *mapping, size_t length)
+{
+    *mem_block_size_t_ptr(mapping) = length;
+    void *block = mem_block_char_ptr(mapping) + kMappedPrefixSize;
+    mem_block_init(block, (length - kMappedPrefixSize - kFooterSize) & ~kBlockStateMask, kBlockAllocated | kBlockMapped);
+    return block;
+}
+#endif
+
+static void *mem_mapped_alloc(size_t size)
+{
+#if defined(__OSDEV_HAVE_MMAN_H__)
+    if (gMmapThreshold && size >= gMmapThreshold && !gHeapFileBacked) {
+        size_t length = mem_mapped_length(size);
+        void *mapping = length ? mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                               : MAP_FAILED;
+
+        if (mapping != MAP_FAILED) {
+            return mem_mapped_init(mapping, length);
+        }
+    }
+#endif
+    (void) size;
+    return nullptr;
+}
+
+static void mem_mapped_free(void *block)
+{
+#if defined(__OSDEV_HAVE_MMAN_H__)
+    char *base = mem_mapped_base(block);
+    munmap(base, *mem_block_size_t_ptr(base));
+#endif
+    (void) block;
+}
+
+/**
+ * Resizes a mapped block while the new size stays above the threshold,
+ * returns nullptr when the block has to go back to the heap.
+ */
+static void *mem_mapped_resize(void *block, size_t size)
+{
+#if defined(__OSDEV_HAVE_MMAN_H__)
+    if (gMmapThreshold && size >= gMmapThreshold) {
+        char *base = mem_mapped_base(block);
+        size_t length = mem_mapped_length(size);
+#if defined(__linux__)
+        void *mapping = length ? mremap(base, *mem_block_size_t_ptr(base), length, MREMAP_MAYMOVE) : MAP_FAILED;
+
+        if (mapping != MAP_FAILED) {
+            return mem_mapped_init(mapping, length);
+        }
+#else
+        void *resized = mem_mapped_alloc(size);
+
+        if (resized) {
+            mem_move(resized, block, min(size, mem_block_size(block)));
+            mem_mapped_free(block);
+            return resized;
+        }
+#endif
+    }
+#endif
+    (void) block;
+    (void) size;
+    return nullptr;
+}
+
+#if defined(__OSDEV_HAVE_MMAN_H__)
+void mem_set_mmap_threshold(size_t threshold)
+{
+    gMmapThreshold = threshold;
+}
+#endif
+
+/* Everything written to the heap so far, including the links of the block at next, is below the clean watermark */
+static void mem_clean_raise(void *next)
+{
+    mem_offset_t used = mem_block_char_ptr(next) + sizeof(ListHead) - gMemStart;
+
+    if (used > gHeap->clean) {
+        gHeap->clean = used;
+    }
+}
+
+/**
+ * Allocates the beginning of a free block which is already out of its bin.
+ * A remainder at the end of the heap stays the top chunk, the remainder of
+ * a small request becomes the victim and the previous victim goes to its
+ * bin, other remainders go straight to their bins.
+ */
+static void *mem_block_carve(void *block, size_t aligned_size)
+{
+    block = mem_block_place(block, aligned_size);
+    auto next = mem_block_next(block);
+    mem_clean_raise(next);
+
+    if (next < gMemEnd && next > gMemStart && mem_block_is_free(next)) {
+        auto nextBlock = mem_block_list_head(next);
+
+        if (mem_block_is_top(next)) {
+            /* Bumped off the top chunk, the rest of it needs no bookkeeping */
+        }
+        else if (aligned_size < kHugeBlockMinSize && !mem_victim_is_room()) {
+            void *victim = mem_victim();
+
+            if (victim) {
+                bin_insert(mem_block_list_head(victim));
+            }
+
+            mem_victim_set(nextBlock);
+        }
+        else {
+            bin_insert(nextBlock);
+        }
+    }
+
+    return block;
+}
+
+static void *mem_block_alloc(size_t aligned_size)
+{
+    void *block = nullptr;
+
+    /* Small requests without an exact fit are served from the victim before the bins are searched */
+    if (aligned_size < kHugeBlockMinSize && !gBinList[aligned_size] && !mem_victim_is_room()) {
+        block = mem_victim();
+
+        if (block && mem_block_size(block) >= aligned_size) {
+            mem_victim_set(nullptr);
+            return mem_block_carve(block, aligned_size);
+        }
+    }
+
+    block = mem_block_take_free(aligned_size);
+
+    if (block) {
+        block = mem_block_carve(block, aligned_size);
+    }
+
+    return block;
+}
+
+/**
+ * Resizes an allocated heap block in place. Growing takes the free block
+ * after it, the part of the block which is not needed any more is given
+ * back as a free block. Returns false when there is no room to grow.
+ */
+/* Size of a block after mem_block_resize_in_place() succeeds, which keeps tails too small to split */
+static size_t mem_block_resized_size(void *block, size_t aligned_size)
+{
+    size_t size = mem_block_size(block);
+
+    if (aligned_size > size) {
+        void *next = mem_block_next(block);
+
+        if (mem_block_is_free(next)) {
+            size += kOverheadSize + mem_block_size(next);
+        }
+    }
+
+    return size - min(size, aligned_size) >= kOverheadSize * 2 ? aligned_size : size;
+}
+
+static bool mem_block_resize_in_place(void *block, size_t aligned_size)
+{
+    size_t size = mem_block_size(block);
+    size_t state = *mem_block_word_ptr(mem_block_header(block)) & kBlockStateMask;
+    bool was_victim = false;
+
+    if (aligned_size > size) {
+        void *next = mem_block_next(block);
+
+        if (!mem_block_is_free(next) || size + kOverheadSize + mem_block_size(next) < aligned_size) {
+            return false;
+        }
+
+        was_victim = next == mem_victim();
+
+        if (was_victim) {
+            mem_victim_set(nullptr);
+        }
+        else {
+            bin_erase(next);
+        }
+
+        mem_check_cursor_absorb(next, block);
+        size += kOverheadSize + mem_block_size(next);
+        mem_block_init(block, size, state);
+    }
+
+    if (size - aligned_size >= kOverheadSize * 2) {
+        mem_block_init(block, aligned_size, state);
+        void *tail = mem_block_next(block);
+        mem_block_init(tail, size - aligned_size - kOverheadSize, kBlockFree);
+        tail = mem_block_erase_merge(tail);
+
+        /* What is left of a victim stays the victim */
+        if (was_victim && !mem_block_is_top(tail)) {
+            mem_victim_set(tail);
+        }
+
+        if (tail != mem_victim()) {
+            mem_block_file(tail);
+        }
+        else {
+            mem_block_list_head(tail);
+        }
+    }
+
+    mem_clean_raise(mem_block_next(block));
+    return true;
+}
+
+/**
+ * Allocates a block whose payload starts at an alignment boundary by
+ * splitting the gap in front of it off as a free block, so no memory is
+ * lost to padding. The alignment must be a power of two and at least
+ * kOverheadSize * 2, so that any gap is large enough for a free block.
+ */
+static void *mem_block_alloc_split_aligned(size_t aligned_size, size_t alignment)
+{
+    void *block = mem_block_take_free(aligned_size + alignment + kOverheadSize * 2);
+
+    if (!block) {
+        return nullptr;
+    }
+
+    auto address = reinterpret_cast<uintptr_t>(block);
+    uintptr_t target = (address + alignment - 1) & ~(alignment - 1);
+
+    /* The leading gap becomes a free block, so it must be able to hold the smallest one */
+    if (target != address && target - address < kOverheadSize * 2) {
+        target += alignment;
+    }
+
+    if (target != address) {
+        size_t gap = target - address;
+        size_t size = mem_block_size(block);
+        void *prev = mem_block_prev(block);
+
+        /* The growth room split off the top chunk may lie right before the block, the gap extends it */
+        if (mem_block_is_free(prev)) {
+            bool victim = prev == mem_victim();
+
+            if (!victim) {
+                bin_erase(prev);
+            }
+
+            mem_block_init(prev, mem_block_size(prev) + gap, kBlockFree);
+
+            if (!victim) {
+                bin_insert(mem_block_list_head(prev));
+            }
+        }
+        else {
+            mem_block_init(block, gap - kOverheadSize, kBlockFree);
+            bin_insert(mem_block_list_head(block));
+        }
+
+        block = reinterpret_cast<void *>(target);
+        mem_block_init(block, size - gap, kBlockFree);
+    }
+
+    return mem_block_carve(block, aligned_size);
+}
+
+/**
+ * Size of a block which starts on a cache line boundary and ends on one, so
+ * no other block's payload can share a line with it.
+ */
+static size_t mem_block_cacheline_size(size_t size)
+{
+    return max(kCacheLineSize, (size + kCacheLineSize - 1) & ~(kCacheLineSize - 1));
+}
+
+void *mem_malloc(size_t size)
+{
+    MEM_SHM_SCOPE(nullptr);
+    MEM_LATENCY_SCOPE(MEM_LATENCY_MALLOC, size);
+    void *block = nullptr;
+
+    if (gMemStart) {
+        if (size > 0) {
+            block = mem_mapped_alloc(size);
+
+            size_t aligned_size = mem_block_aligned_size(size);
+
+            /* Keep large blocks on huge page boundaries so they span as few huge pages as possible */
+            if (!block && gHugePageSize && aligned_size >= gHugePageSize) {
+                block = mem_block_alloc_split_aligned(aligned_size, gHugePageSize);
+            }
+
+            if (!block && gCacheLineThreshold && size >= gCacheLineThreshold) {
+                block = mem_block_alloc_split_aligned(mem_block_cacheline_size(size), kCacheLineSize);
+            }
+
+            if (!block) {
+                block = mem_block_alloc(aligned_size);
+            }
+        }
+        else {
+            ALOGE("Could not allocate block with size %zu", size);
+#if defined(__OSDEV_HAVE_ERRNO_H__)
+            errno = EINVAL;
+#endif
+        }
+    }
+    else {
+#if defined(__OSDEV_HAVE_ERRNO_H__)
+        errno = EINVAL;
+#endif
+        ALOGE("Not initialized");
+    }
+
+    mem_profile_alloc(block, size);
+    return block;
+}
+
+void *mem_malloc_cacheline(size_t size)
+{
+    MEM_SHM_SCOPE(nullptr);
+
+    if (!gMemStart || size == 0 || size > SIZE_MAX - kCacheLineSize) {
+        return mem_malloc(size);
+    }
+
+    MEM_LATENCY_SCOPE(MEM_LATENCY_MALLOC, size);
+    void *block = mem_mapped_alloc(size);
+
+    if (!block) {
+        block = mem_block_alloc_split_aligned(mem_block_cacheline_size(size), kCacheLineSize);
+    }
+
+    mem_profile_alloc(block, size);
+    return block;
+}
+
+/**
+ * Carves a buffer which is expected to grow to reserve bytes from the front
+ * of a free block which could hold reserve. The rest becomes the victim or
+ * stays the top chunk, and is kept as the buffer's growth room.
+ */
+static void *mem_block_alloc_hint(size_t aligned_size, size_t reserve)
+{
+    void *block = mem_block_take_free(reserve + kOverheadSize);
+
+    if (!block) {
+        block = mem_block_alloc(aligned_size);
+    }
+    else {
+        block = mem_block_place(block, aligned_size);
+        auto next = mem_block_next(block);
+        mem_clean_raise(next);
+
+        if (next < gMemEnd && mem_block_is_free(next) && !mem_block_is_top(next)) {
+            void *victim = mem_victim();
+
+            if (victim) {
+                bin_insert(mem_block_list_head(victim));
+            }
+
+            mem_victim_set(mem_block_list_head(next));
+        }
+        else if (next < gMemEnd && mem_block_is_free(next)) {
+            mem_block_list_head(next);
+        }
+    }
+
+    if (block) {
+        gHeap->hint = mem_block_char_ptr(block) - gMemStart;
+        gHeap->hint_end = gHeap->hint + reserve;
+    }
+
+    return block;
+}
+
+void *mem_malloc_hint(size_t size, size_t expected_max)
+{
+    MEM_SHM_SCOPE(nullptr);
+
+    if (!gMemStart || size == 0 || expected_max <= size || expected_max > kMaxBlockSize / 2) {
+        return mem_malloc(size);
+    }
+
+    MEM_LATENCY_SCOPE(MEM_LATENCY_MALLOC, size);
+    void *block = mem_mapped_alloc(size);
+
+    if (!block) {
+        block = mem_block_alloc_hint(mem_block_aligned_size(size), mem_block_aligned_size(expected_max));
+    }
+
+    mem_profile_alloc(block, size);
+    return block;
+}
+
+void mem_set_cacheline_threshold(size_t threshold)
+{
+    gCacheLineThreshold = threshold;
+}
+
+static size_t mem_aligned_mem_size(size_t size,
+                                   size_t align)
+{
+    return size
+        + max(sizeof(size_t), alignof(size_t))
+        + align - 1;
+}
+
+/* Fresh mappings are already zeroed, heap blocks only need their dirty prefix cleared */
+static void mem_clear_fresh(void *block, void *ptr, size_t count, mem_offset_t clean)
+{
+    if (!mem_block_is_mapped(block)) {
+        mem_offset_t offset = mem_block_char_ptr(ptr) - gMemStart;
+        size_t dirty = offset < clean ? min(count, clean - offset) : 0;
+        mem_zero(ptr, dirty);
+    }
+}
+
+static void *mem_block_resolve_from_aligned(void *ptr)
+{
+    auto p = ptr;
+
+    if (!mem_block_check_block(ptr)) {
+        auto offset = *mem_block_get_magic_from_header(ptr);
+        p = mem_block_char_ptr(ptr) - offset;
+    }
+
+    return p;
+}
+
+void *mem_malloc_aligned(size_t size, size_t alignment)
+{
+    MEM_SHM_SCOPE(nullptr);
+    MEM_LATENCY_SCOPE(MEM_LATENCY_MALLOC_ALIGNED, size);
+
+    if (alignment > kAlignment) {
+        size_t size_with_alignment = mem_aligned_mem_size(size, alignment);
+        void *ptr = mem_malloc(size_with_alignment);
+
+        if (ptr) {
+            auto address = reinterpret_cast<size_t>(ptr);
+            auto aligned_ptr =
+                reinterpret_cast<void *>(alignment
+                    * ((address + sizeof(size_t) /* offset */ + alignment - 1) / alignment));
+            *mem_block_get_magic_from_header(aligned_ptr) = mem_block_char_ptr(aligned_ptr) - mem_block_char_ptr(ptr);
+            return aligned_ptr;
+        }
+
+        /* A plain block would not be aligned, so a failed padded request fails the call */
+        return nullptr;
+    }
+
+    return mem_malloc(size);
+}
+
+void *mem_calloc(size_t num, size_t size)
+{
+    MEM_SHM_SCOPE(nullptr);
+
+    if (size != 0 && num > SIZE_MAX / size) {
+        return nullptr;
+    }
+
+    size_t count = size * num;
+    mem_offset_t clean = gMemStart ? gHeap->clean : 0;
+    void *p = mem_malloc(count);
+
+    if (p != nullptr) {
+        mem_clear_fresh(p, p, count, clean);
+    }
+
+    return p;
+}
+
+/**
+ * Tag related stuff. A tagged block keeps its tag in the first payload word
+ * and hands out the payload behind a prefix of at least kAlignment bytes.
+ * The prefix length is stored in front of the payload like the offset of an
+ * aligned block, so mem_block_resolve_from_aligned() finds the block.
+ * Live bytes count the whole block, prefix included.
+ */
+
+static unsigned mem_block_tag(void *block)
+{
+    return static_cast<unsigned>(*reinterpret_cast<size_t *>(block));
+}
+
+/* The tag itself is already in the first payload word */
+static void mem_block_mark_tagged(void *block)
+{
+    size_t state = *mem_block_word_ptr(mem_block_header(block)) & kBlockStateMask;
+    mem_block_init(block, mem_block_size(block), state | kBlockTagged);
+}
+
+static MemTagStats *mem_tag_stats_of(void *block)
+{
+    return &gHeap->tags[mem_block_tag(block)];
+}
+
+static void mem_tag_charge(void *block)
+{
+    if (mem_block_is_tagged(block)) {
+        MemTagStats *stats = mem_tag_stats_of(block);
+        stats->live_bytes += mem_block_size(block);
+        ++stats->live_count;
+    }
+}
+
+static void mem_tag_release(void *block)
+{
+    if (mem_block_is_tagged(block)) {
+        MemTagStats *stats = mem_tag_stats_of(block);
+        stats->live_bytes -= mem_block_size(block);
+        --stats->live_count;
+    }
+}
+
+/**
+ * Whether a tag stays within its limit when a block holding held bytes of it
+ * grows to size. Callers pass the requested size for a quick check first,
+ * the block size which is actually charged is checked once it is known.
+ */
+static bool mem_tag_allows(unsigned tag, size_t held, size_t size)
+{
+    const MemTagStats &stats = gHeap->tags[tag];
+    /* A block which does not grow is always allowed, even when the limit has been lowered meanwhile */
+    return !stats.limit || size <= held || (size <= stats.limit && stats.live_bytes - held <= stats.limit - size);
+}
+
+/* Requests over the limit of their tag fail like requests the heap cannot serve */
+static void *mem_tag_refuse()
+{
+#if defined(__OSDEV_HAVE_ERRNO_H__)
+    errno = ENOMEM;
+#endif
+    return nullptr;
+}
+
+/* A tagged mapped block may only grow when the whole new mapping fits the limit */
+static bool mem_tag_allows_mapped(void *block, size_t size)
+{
+#if defined(__OSDEV_HAVE_MMAN_H__)
+    return !mem_block_is_tagged(block)
+        || mem_tag_allows(mem_block_tag(block), mem_block_size(block), mem_mapped_block_size(size));
+#else
+    (void) block;
+    (void) size;
+    return true;
+#endif
+}
+
+/* A tagged heap block may only grow in place when its size after the resize fits the limit */
+static bool mem_tag_allows_in_place(void *block, size_t aligned_size)
+{
+    return !mem_block_is_tagged(block)
+        || mem_tag_allows(mem_block_tag(block), mem_block_size(block), mem_block_resized_size(block, aligned_size));
+}
+
+void *mem_malloc_aligned_tagged(size_t size, size_t alignment, unsigned tag)
+{
+    MEM_SHM_SCOPE(nullptr);
+
+    if (!gMemStart || tag >= MEM_TAG_COUNT || (alignment & (alignment - 1)) != 0
+        || size == 0 || size > SIZE_MAX - kAlignment - alignment) {
+        ALOGE("Could not allocate tagged block with size %zu alignment %zu tag %u", size, alignment, tag);
+#if defined(__OSDEV_HAVE_ERRNO_H__)
+        errno = EINVAL;
+#endif
+        return nullptr;
+    }
+
+    if (!mem_tag_allows(tag, 0, size)) {
+        return mem_tag_refuse();
+    }
+
+    if (!kBlockTagged) {
+        return mem_malloc_aligned(size, alignment);
+    }
+
+    /* Blocks are kAlignment aligned, so the padding never exceeds the alignment */
+    alignment = max(alignment, kAlignment);
+    void *block = mem_malloc(size + alignment);
+
+    if (!block) {
+        return nullptr;
+    }
+
+    if (!mem_tag_allows(tag, 0, mem_block_size(block))) {
+        mem_free(block);
+        return mem_tag_refuse();
+    }
+
+    auto address = reinterpret_cast<uintptr_t>(block);
+    size_t offset = ((address + kAlignment + alignment - 1) & ~(alignment - 1)) - address;
+    void *ptr = mem_block_char_ptr(block) + offset;
+    *reinterpret_cast<size_t *>(block) = tag;
+    *mem_block_get_magic_from_header(ptr) = offset;
+    mem_block_mark_tagged(block);
+    mem_tag_charge(block);
+    return ptr;
+}
+
+void *mem_malloc_tagged(size_t size, unsigned tag)
+{
+    return mem_malloc_aligned_tagged(size, kAlignment, tag);
+}
+
+void *mem_calloc_tagged(size_t num, size_t size, unsigned tag)
+{
+    MEM_SHM_SCOPE(nullptr);
+
+    if (size != 0 && num > SIZE_MAX / size) {
+        return nullptr;
+    }
+
+    size_t count = size * num;
+    mem_offset_t clean = gMemStart ? gHeap->clean : 0;
+    void *p = mem_malloc_tagged(count, tag);
+
+    if (p != nullptr) {
+        mem_clear_fresh(mem_block_resolve_from_aligned(p), p, count, clean);
+    }
+
+    return p;
+}
+
+int mem_tag_stats(unsigned tag, MemTagStats *stats)
+{
+    MEM_SHM_SCOPE(shmScope.error);
+
+    if (!gMemStart || tag >= MEM_TAG_COUNT || !stats) {
+        return EINVAL;
+    }
+
+    *stats = gHeap->tags[tag];
+    return 0;
+}
+
+int mem_tag_set_limit(unsigned tag, size_t limit)
+{
+    MEM_SHM_SCOPE(shmScope.error);
+
+    if (!gMemStart || tag >= MEM_TAG_COUNT) {
+        return EINVAL;
+    }
+
+    gHeap->tags[tag].limit = limit;
+    return 0;
+}
+
+void *mem_realloc(void *ptr, size_t new_sz)
+{
+    MEM_SHM_SCOPE(nullptr);
+    MEM_LATENCY_SCOPE(MEM_LATENCY_REALLOC, new_sz);
+
+    if (!ptr) {
+        return mem_malloc(new_sz);
+    }
+
+    void *p = mem_block_resolve_from_aligned(ptr);
+    bool valid = mem_block_check_block(p);
+    size_t offset = mem_block_char_ptr(ptr) - mem_block_char_ptr(p);
+
+    if (valid && mem_block_is_tagged(p) && !mem_tag_allows(mem_block_tag(p), mem_block_size(p), offset + new_sz)) {
+        return mem_tag_refuse();
+    }
+
+    /* The mapping keeps the prefix of an aligned or tagged block in front of the payload */
+    if (valid && mem_block_is_mapped(p)) {
+        if (!mem_tag_allows_mapped(p, offset + new_sz)) {
+            return mem_tag_refuse();
+        }
+
+        bool tagged = mem_block_is_tagged(p);
+        mem_tag_release(p);
+        void *resized = mem_mapped_resize(p, offset + new_sz);
+
+        if (resized) {
+            mem_profile_free(p);
+            mem_profile_alloc(resized, new_sz);
+            p = resized;
+
+            if (tagged) {
+                mem_block_mark_tagged(p);
+            }
+        }
+
+        mem_tag_charge(p);
+
+        if (resized) {
+            return mem_block_char_ptr(p) + offset;
+        }
+    }
+
+    /* Shrinking and growing into a free successor keep the payload where it is */
+    if (valid && new_sz > 0 && mem_block_is_allocated(p) && !mem_block_is_mapped(p)
+        && new_sz < kMaxBlockSize - offset - kAlignment * 2) {
+        size_t aligned_size = mem_block_aligned_size(offset + new_sz);
+
+        if (!mem_tag_allows_in_place(p, aligned_size)) {
+            return mem_tag_refuse();
+        }
+
+        mem_tag_release(p);
+        bool resized = mem_block_resize_in_place(p, aligned_size);
+        mem_tag_charge(p);
+
+        if (resized) {
+            mem_profile_free(p);
+            mem_profile_alloc(p, new_sz);
+            return ptr;
+        }
+    }
+
+    auto block = valid && mem_block_is_tagged(p) ? mem_malloc_tagged(new_sz, mem_block_tag(p)) : mem_malloc(new_sz);
+
+    /* Only the payload after the alignment padding is live */
+    if (block && valid) {
+        mem_move(block, ptr, min(new_sz, mem_block_size(p) - (mem_block_char_ptr(ptr) - mem_block_char_ptr(p))));
+        mem_free(ptr);
+    }
+
+    return block;
+}
+
+void *mem_realloc_aligned(void *ptr, size_t new_sz, size_t alignment)
+{
+    MEM_SHM_SCOPE(nullptr);
+    MEM_LATENCY_SCOPE(MEM_LATENCY_REALLOC, new_sz);
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        ALOGE("Could not reallocate block with alignment %zu", alignment);
+#if defined(__OSDEV_HAVE_ERRNO_H__)
+        errno = EINVAL;
+#endif
+        return nullptr;
+    }
+
+    if (!ptr) {
+        return mem_malloc_aligned(new_sz, alignment);
+    }
+
+    void *p = mem_block_resolve_from_aligned(ptr);
+
+    if (!mem_block_check_block(p) || !mem_block_is_allocated(p)) {
+        ALOGE("%s(): Invalid pointer (%p)\n", __func__, ptr);
+        return nullptr;
+    }
+
+    size_t offset = mem_block_char_ptr(ptr) - mem_block_char_ptr(p);
+    bool aligned = (reinterpret_cast<uintptr_t>(ptr) & (alignment - 1)) == 0;
+
+    if (mem_block_is_tagged(p) && !mem_tag_allows(mem_block_tag(p), mem_block_size(p), offset + new_sz)) {
+        return mem_tag_refuse();
+    }
+
+    /* A mapping keeps its page offset when it is remapped, so the padding still aligns the payload */
+    if (mem_block_is_mapped(p)) {
+        if (!mem_tag_allows_mapped(p, offset + new_sz)) {
+            return mem_tag_refuse();
+        }
+
+        bool tagged = mem_block_is_tagged(p);
+        mem_tag_release(p);
+        void *resized = mem_mapped_resize(p, offset + new_sz);
+
+        if (resized) {
+            mem_profile_free(p);
+            mem_profile_alloc(resized, new_sz);
+            p = resized;
+            ptr = mem_block_char_ptr(p) + offset;
+            aligned = (reinterpret_cast<uintptr_t>(ptr) & (alignment - 1)) == 0;
+
+            if (tagged) {
+                mem_block_mark_tagged(p);
+            }
+        }
+
+        mem_tag_charge(p);
+
+        if (resized && aligned) {
+            return ptr;
+        }
+    }
+    else if (aligned && new_sz < kMaxBlockSize - offset - kAlignment * 2) {
+        size_t aligned_size = mem_block_aligned_size(offset + new_sz);
+
+        if (!mem_tag_allows_in_place(p, aligned_size)) {
+            return mem_tag_refuse();
+        }
+
+        mem_tag_release(p);
+        bool resized = mem_block_resize_in_place(p, aligned_size);
+        mem_tag_charge(p);
+
+        if (resized) {
+            mem_profile_free(p);
+            mem_profile_alloc(p, new_sz);
+            return ptr;
+        }
+    }
+
+    void *block = mem_block_is_tagged(p)
+        ? mem_malloc_aligned_tagged(new_sz, alignment, mem_block_tag(p))
+        : mem_malloc_aligned(new_sz, alignment);
+
+    if (block) {
+        mem_move(block, ptr, min(new_sz, mem_block_size(p) - offset));
+        mem_free(ptr);
+    }
+
+    return block;
+}
+
+void mem_free(void *ptr)
+{
+    MEM_SHM_SCOPE();
+
+    if (ptr) {
+        void *p = mem_block_resolve_from_aligned(ptr);
+
+        if (mem_block_check_block(p)) {
+            MEM_LATENCY_SCOPE(MEM_LATENCY_FREE, mem_block_size(p));
+            mem_profile_free(p);
+            mem_tag_release(p);
+
+            if (mem_block_is_mapped(p)) {
+                mem_mapped_free(p);
+            }
+            else if (mem_block_is_allocated(p)) {
+                size_t size = mem_block_size(p);
+                mem_block_init(p, size, kBlockFree);
+                p = mem_block_erase_merge(p);
+
+                if (p != mem_victim()) {
+                    mem_block_file(p);
+                }
+                else {
+                    mem_block_list_head(p);
+                }
+            }
+        }
+        else {
+            ALOGE("%s(): Invalid pointer (%p)\n", __func__, ptr);
+        }
+    }
+}
+
+/* In place heap sort, so a batch of any size is ordered without allocating */
+static void mem_sort_addresses(void **items, size_t n)
+{
+    auto sift_down = [items](size_t root, size_t end) {
+        while (root * 2 + 1 < end) {
+            size_t child = root * 2 + 1;
+
+            if (child + 1 < end && items[child] < items[child + 1]) {
+                ++child;
+            }
+
+            if (items[root] >= items[child]) {
+                return;
+            }
+
+            void *tmp = items[root];
+            items[root] = items[child];
+            items[child] = tmp;
+            root = child;
+        }
+    };
+
+    for (size_t i = n / 2; i > 0; --i) {
+        sift_down(i - 1, n);
+    }
+
+    for (size_t end = n; end > 1; --end) {
+        void *tmp = items[0];
+        items[0] = items[end - 1];
+        items[end - 1] = tmp;
+        sift_down(0, end - 1);
+    }
+}
+
+/* Merges two chains of free blocks linked through next only, keeping equal sizes in order */
+static ListHead *mem_chain_merge(ListHead *first, ListHead *second)
+{
+    ListHead *head = nullptr;
+    ListHead *tail = nullptr;
+
+    while (first || second) {
+        ListHead *block;
+
+        if (!second || (first && mem_block_size(first) <= mem_block_size(second))) {
+            block = first;
+            first = first->next;
+        }
+        else {
+            block = second;
+            second = second->next;
+        }
+
+        block->prev = tail;
+
+        if (tail) {
+            tail->next = block;
+        }
+        else {
+            head = block;
+        }
+
+        tail = block;
+    }
+
+    if (tail) {
+        tail->next = nullptr;
+    }
+
+    return head;
+}
+
+static ListHead *mem_chain_sort_by_size(ListHead *chain)
+{
+    if (!chain || !chain->next) {
+        return chain;
+    }
+
+    ListHead *slow = chain;
+    ListHead *fast = chain->next;
+
+    while (fast && fast->next) {
+        slow = slow->next;
+        fast = fast->next->next;
+    }
+
+    ListHead *second = slow->next;
+    slow->next = nullptr;
+    return mem_chain_merge(mem_chain_sort_by_size(chain), mem_chain_sort_by_size(second));
+}
+
+/**
+ * Frees n pointers at once. The blocks are sorted by address, every run of
+ * adjacent blocks becomes one free block and is merged with its neighbours
+ * once, and a coalesced block is filed only when the next run cannot reach
+ * it any more. Blocks for the sorted huge bin are sorted among themselves
+ * and merged into it in one pass instead of one walk each. The array is
+ * reordered and overwritten.
+ */
+void mem_free_batch(void **ptrs, size_t n)
+{
+    MEM_SHM_SCOPE();
+
+    if (!ptrs) {
+        return;
+    }
+
+    size_t count = 0;
+
+    for (size_t i = 0; i < n; ++i) {
+        if (!ptrs[i]) {
+            continue;
+        }
+
+        void *p = mem_block_resolve_from_aligned(ptrs[i]);
+
+        if (!mem_block_check_block(p)) {
+            ALOGE("%s(): Invalid pointer (%p)\n", __func__, ptrs[i]);
+            continue;
+        }
+
+        if (mem_block_is_allocated(p)) {
+            ptrs[count++] = p;
+        }
+    }
+
+    mem_sort_addresses(ptrs, count);
+
+    /* A pointer passed twice is adjacent to itself after sorting, it is released once */
+    size_t unique = 0;
+    void *last = nullptr;
+
+    for (size_t i = 0; i < count; ++i) {
+        void *p = ptrs[i];
+
+        if (p == last) {
+            continue;
+        }
+
+        last = p;
+        mem_profile_free(p);
+        mem_tag_release(p);
+
+        if (mem_block_is_mapped(p)) {
+            mem_mapped_free(p);
+        }
+        else {
+            ptrs[unique++] = p;
+        }
+    }
+
+    count = unique;
+    void *pending = nullptr;
+    ListHead *huge = nullptr;
+    auto file = [&huge](void *block) {
+        if (mem_block_size(block) < kHugeBinIndex || mem_block_is_top(block)) {
+            mem_block_file(block);
+        }
+        else {
+            auto head = mem_block_list_head(block);
+            head->next = huge;
+            huge = head;
+        }
+    };
+
+    for (size_t i = 0; i < count; ++i) {
+        void *p = ptrs[i];
+        void *end = p;
+
+        while (i + 1 < count && ptrs[i + 1] == mem_block_next(end)) {
+            end = ptrs[++i];
+            mem_check_cursor_absorb(end, p);
+        }
+
+        mem_block_init(p, mem_block_char_ptr(end) + mem_block_size(end) - mem_block_char_ptr(p), kBlockFree);
+
+        /* The previous run is still out of the bins, it is merged into this one if they touch */
+        if (pending && mem_block_prev(p) != pending) {
+            if (pending != mem_victim()) {
+                file(pending);
+            }
+        }
+
+        pending = mem_block_erase_merge(p);
+        mem_block_list_head(pending);
+    }
+
+    if (pending && pending != mem_victim()) {
+        file(pending);
+    }
+
+    if (huge) {
+        gBinList[kHugeBinIndex] = mem_chain_merge(gBinList[kHugeBinIndex], mem_chain_sort_by_size(huge));
+    }
+}
+
+#if BINS_ARE_IN_HEAP || defined(__OSDEV_HAVE_MMAN_H__)
+static size_t mem_heap_state_size()
+{
+    return kAlignment * ((sizeof(MemHeapState) + kAlignment - 1) / kAlignment);
+}
+#endif
+
+static bool mem_heap_size_is_valid(size_t size, size_t stateSize)
+{
+    return size > 0 && (size % 2 == 0) && size > stateSize + kHeaderPadding + kOverheadSize * 6
+        && size - stateSize <= static_cast<mem_offset_t>(~mem_offset_t{});
+}
+
+/**
+ * Writes the service blocks and the first free block. gHeap must already
+ * point to the state the heap will use, stateSize bytes at base are reserved
+ * for it when it lives in the region.
+ */
+static void mem_heap_format(void *base, size_t size, size_t stateSize, bool zeroed)
+{
+    *gHeap = MemHeapState{};
+    gHeap->magic = kHeapMagicNumber;
+    gHeap->version = kHeapVersion;
+    gHeap->header_size = kHeaderSize;
+    gHeap->size = size;
+    gBinList = gHeap->bins;
+
+    gMemStart = mem_block_char_ptr(base) + stateSize + kHeaderPadding;
+    size -= stateSize + kHeaderPadding;
+    size -= size % kAlignment;
+    mem_block_init(mem_block_char_ptr(gMemStart) + kHeaderSize, kOverheadSize, kBlockAllocated);
+    size_t heapSize = size - (kOverheadSize * 5);
+    void *heap = mem_block_next(mem_block_user_ptr(gMemStart));
+    mem_block_init(heap, heapSize, kBlockFree);
+    gMemEnd = mem_block_char_ptr(mem_block_next(heap)) - kHeaderSize;
+    mem_block_init(mem_block_char_ptr(gMemEnd) + kHeaderSize, kOverheadSize, kBlockAllocated);
+    gHeap->start = stateSize + kHeaderPadding;
+    gHeap->end = gMemEnd - gMemStart;
+    mem_profile_drop_live();
+    ++gHeapGeneration;
+    gHeap->clean = zeroed ? mem_block_char_ptr(heap) + sizeof(ListHead) - gMemStart : gHeap->end;
+    /* The whole heap starts as the top chunk */
+    mem_block_list_head(heap);
+}
+
+/**
+ * Handle related stuff. A movable block starts with a kAlignment sized prefix
+ * holding its handle, so compaction can find the table entry to update.
+ */
+
+static MemHandle *mem_handle_table()
+{
+    return reinterpret_cast<MemHandle *>(gMemStart + gHeap->handles);
+}
+
+static MemHandle *mem_handle_entry(mem_handle_t handle)
+{
+    if (gMemStart && gHeap->handles && handle > 0 && handle <= gHeap->handle_capacity) {
+        auto entry = mem_handle_table() + handle - 1;
+
+        if (entry->block) {
+            return entry;
+        }
+    }
+
+    ALOGE("Invalid handle %zu", handle);
+    return nullptr;
+}
+
+static bool mem_handle_table_grow()
+{
+    size_t capacity = max(gHeap->handle_capacity * 2, kHandleTableMinCapacity);
+    auto table = reinterpret_cast<MemHandle *>(mem_block_alloc(mem_block_aligned_size(capacity * sizeof(MemHandle))));
+
+    if (!table) {
+        return false;
+    }
+
+    size_t old_capacity = gHeap->handle_capacity;
+
+    if (old_capacity) {
+        mem_move(table, mem_handle_table(), old_capacity * sizeof(MemHandle));
+        mem_free(mem_handle_table());
+    }
+
+    for (size_t i = old_capacity; i < capacity; ++i) {
+        table[i].block = 0;
+        table[i].locks = i + 1 < capacity ? i + 2 : gHeap->handle_free;
+    }
+
+    gHeap->handle_free = old_capacity + 1;
+    gHeap->handle_capacity = capacity;
+    gHeap->handles = mem_block_char_ptr(table) - gMemStart;
+    return true;
+}
+
+mem_handle_t mem_handle_alloc(size_t size)
+{
+    MEM_SHM_SCOPE(0);
+
+    if (!gMemStart || size == 0) {
+        return 0;
+    }
+
+    if (!gHeap->handle_free && !mem_handle_table_grow()) {
+        return 0;
+    }
+
+    /* Movable blocks always stay in the heap, never in a dedicated mapping */
+    void *block = mem_block_alloc(mem_block_aligned_size(size + kAlignment));
+
+    if (!block) {
+        return 0;
+    }
+
+    mem_handle_t handle = gHeap->handle_free;
+    auto entry = mem_handle_table() + handle - 1;
+    gHeap->handle_free = entry->locks;
+    entry->block = mem_block_char_ptr(block) - gMemStart;
+    entry->locks = 0;
+    *mem_block_size_t_ptr(block) = handle;
+    mem_block_init(block, mem_block_size(block), kBlockAllocated | kBlockMovable);
+    return handle;
+}
+
+void *mem_handle_lock(mem_handle_t handle)
+{
+    MEM_SHM_SCOPE(nullptr);
+
+    auto entry = mem_handle_entry(handle);
+
+    if (entry) {
+        ++entry->locks;
+        return gMemStart + entry->block + kAlignment;
+    }
+
+    return nullptr;
+}
+
+void mem_handle_unlock(mem_handle_t handle)
+{
+    MEM_SHM_SCOPE();
+
+    auto entry = mem_handle_entry(handle);
+
+    if (entry && entry->locks > 0) {
+        --entry->locks;
+    }
+}
+
+void mem_handle_free(mem_handle_t handle)
+{
+    MEM_SHM_SCOPE();
+
+    auto entry = mem_handle_entry(handle);
+
+    if (entry) {
+        mem_free(gMemStart + entry->block);
+        entry->block = 0;
+        entry->locks = gHeap->handle_free;
+        gHeap->handle_free = handle;
+    }
+}
+
+static void mem_compact_flush_hole(void *hole, size_t hole_size, size_t *largest)
+{
+    size_t size = hole_size - kOverheadSize;
+    mem_block_init(hole, size, kBlockFree);
+    mem_block_file(hole);
+    *largest = max(*largest, size);
+}
+
+size_t mem_compact()
+{
+    MEM_SHM_SCOPE(0);
+
+    size_t largest = 0;
+
+    if (!gMemStart) {
+        return largest;
+    }
+
+    for (size_t index = 0; index < kBinCount; ++index) {
+        gBinList[index] = nullptr;
+    }
+
+    /* Every free block, the victim included, is rebuilt into the bins */
+    mem_victim_set(nullptr);
+    gHeap->check_cursor = 0;
+    void *hole = nullptr;
+    size_t hole_size = 0;
+    void *end = mem_block_user_ptr(gMemEnd);
+    void *block = mem_block_next(mem_block_user_ptr(gMemStart));
+
+    while (block != end) {
+        void *next = mem_block_next(block);
+        size_t size_with_overhead = mem_block_size_with_overhead(block);
+
+        if (mem_block_is_free(block)) {
+            hole = hole ? hole : block;
+            hole_size += size_with_overhead;
+        }
+        else if (hole && mem_block_is_movable(block)
+            && mem_handle_table()[*mem_block_size_t_ptr(block) - 1].locks == 0) {
+            mem_move(mem_block_header(hole), mem_block_header(block), size_with_overhead);
+            mem_handle_table()[*mem_block_size_t_ptr(hole) - 1].block = mem_block_char_ptr(hole) - gMemStart;
+            hole = mem_block_next(hole);
+        }
+        else if (hole) {
+            mem_compact_flush_hole(hole, hole_size, &largest);
+            hole = nullptr;
+            hole_size = 0;
+        }
+
+        block = next;
+    }
+
+    if (hole) {
+        mem_compact_flush_hole(hole, hole_size, &largest);
+    }
+
+    return largest;
+}
+
+/**
+ * Arenas. An arena hands out memory from chunks taken from the heap with
+ * mem_malloc() by bumping a cursor, individual allocations are never freed.
+ * The arena descriptor lives at the start of its first chunk, which is kept
+ * on reset, later chunks are linked in front of it.
+ */
+
+struct MemArenaChunk
+{
+    MemArenaChunk *next;
+    size_t size;
+};
+
+struct MemArena
+{
+    MemArenaChunk *chunks;
+    char *cursor;
+    char *limit;
+    size_t chunk_size;
+};
+
+static MemArenaChunk *mem_arena_first_chunk(MemArena *arena)
+{
+    return reinterpret_cast<MemArenaChunk *>(arena) - 1;
+}
+
+static char *mem_arena_chunk_data(MemArenaChunk *chunk)
+{
+    return reinterpret_cast<char *>(chunk + 1);
+}
+
+MemArena *mem_arena_create(size_t chunk_size)
+{
+    size_t size = sizeof(MemArenaChunk) + sizeof(MemArena) + chunk_size;
+
+    if (chunk_size == 0 || size < chunk_size) {
+        ALOGE("Could not create arena with chunk size %zu", chunk_size);
+#if defined(__OSDEV_HAVE_ERRNO_H__)
+        errno = EINVAL;
+#endif
+        return nullptr;
+    }
+
+    auto chunk = static_cast<MemArenaChunk *>(mem_malloc(size));
+
+    if (!chunk) {
+        return nullptr;
+    }
+
+    chunk->next = nullptr;
+    chunk->size = size;
+    auto arena = reinterpret_cast<MemArena *>(mem_arena_chunk_data(chunk));
+    arena->chunks = chunk;
+    arena->chunk_size = chunk_size;
+    arena->cursor = reinterpret_cast<char *>(arena + 1);
+    arena->limit = mem_block_char_ptr(chunk) + size;
+    return arena;
+}
+
+/* Slow path of mem_arena_alloc(), starts a new chunk big enough for the request */
+static void *mem_arena_grow(MemArena *arena, size_t size, size_t align)
+{
+    size_t needed = sizeof(MemArenaChunk) + align - 1 + size;
+
+    if (needed < size) {
+        return nullptr;
+    }
+
+    size_t chunk_size = max(needed, sizeof(MemArenaChunk) + arena->chunk_size);
+    auto chunk = static_cast<MemArenaChunk *>(mem_malloc(chunk_size));
+
+    if (!chunk) {
+        return nullptr;
+    }
+
+    chunk->next = arena->chunks;
+    chunk->size = chunk_size;
+    arena->chunks = chunk;
+    auto address = reinterpret_cast<uintptr_t>(mem_arena_chunk_data(chunk));
+    auto p = reinterpret_cast<char *>((address + align - 1) & ~(align - 1));
+    arena->cursor = p + size;
+    arena->limit = mem_block_char_ptr(chunk) + chunk_size;
+    return p;
+}
+
+void *mem_arena_alloc(MemArena *arena, size_t size, size_t align)
+{
+    align = align ? align : kAlignment;
+
+    if (!arena || (align & (align - 1)) != 0) {
+        ALOGE("%s(): Invalid arena %p or alignment %zu", __func__, arena, align);
+#if defined(__OSDEV_HAVE_ERRNO_H__)
+        errno = EINVAL;
+#endif
+        return nullptr;
+    }
+
+    auto address = reinterpret_cast<uintptr_t>(arena->cursor);
+    auto p = reinterpret_cast<char *>((address + align - 1) & ~(align - 1));
+
+    if (p <= arena->limit && size <= static_cast<size_t>(arena->limit - p)) {
+        arena->cursor = p + size;
+        return p;
+    }
+
+    return mem_arena_grow(arena, size, align);
+}
+
+void mem_arena_reset(MemArena *arena)
+{
+    if (!arena) {
+        return;
+    }
+
+    auto first = mem_arena_first_chunk(arena);
+
+    while (arena->chunks != first) {
+        auto next = arena->chunks->next;
+        mem_free(arena->chunks);
+        arena->chunks = next;
+    }
+
+    arena->cursor = reinterpret_cast<char *>(arena + 1);
+    arena->limit = mem_block_char_ptr(first) + first->size;
+}
+
+void mem_arena_destroy(MemArena *arena)
+{
+    if (arena) {
+        mem_arena_reset(arena);
+        mem_free(mem_arena_first_chunk(arena));
+    }
+}
+
+/**
+ * Prefault related stuff. Pages are faulted in with MADV_POPULATE_WRITE when
+ * the kernel has it, otherwise each page is read and written back, which
+ * keeps its contents, so a live heap can be warmed too. Ranges of at least
+ * kPrefaultParallelMin bytes are split among threads.
+ */
+
+/* Pages are touched at this stride, no page is smaller */
+static constexpr size_t kPrefaultStride = 4096;
+
+static constexpr size_t kPrefaultParallelMin = size_t(1) << 30;
+
+/* Each prefault thread takes at least this many bytes */
+static constexpr size_t kPrefaultThreadMin = size_t(256) << 20;
+
+static constexpr size_t kPrefaultMaxThreads = 16;
+
+static void mem_prefault_pages(char *begin, size_t length)
+{
+    if (length == 0) {
+        return;
+    }
+
+#if defined(__OSDEV_HAVE_MMAN_H__) && defined(MADV_POPULATE_WRITE)
+    char *page = reinterpret_cast<char *>(reinterpret_cast<uintptr_t>(begin) & ~(kPrefaultStride - 1));
+
+    if (madvise(page, begin + length - page, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+    volatile char *cursor = begin;
+    volatile char *last = begin + length - 1;
+
+    for (; cursor < last; cursor += kPrefaultStride) {
+        *cursor = *cursor;
+    }
+
+    *last = *last;
+}
+
+#if defined(__OSDEV_HAVE_PTHREAD_H__)
+struct MemPrefaultSlice
+{
+    char *begin;
+    size_t length;
+};
+
+static void *mem_prefault_thread(void *arg)
+{
+    auto slice = static_cast<MemPrefaultSlice *>(arg);
+    mem_prefault_pages(slice->begin, slice->length);
+    return nullptr;
+}
+#endif
+
+static void mem_prefault_range(char *begin, size_t length)
+{
+#if defined(__OSDEV_HAVE_PTHREAD_H__)
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t count = min(length / kPrefaultThreadMin, kPrefaultMaxThreads);
+
+    if (length >= kPrefaultParallelMin && cpus > 1 && count > 1) {
+        count = min(count, size_t(cpus));
+        size_t step = (length / count + kPrefaultStride - 1) & ~(kPrefaultStride - 1);
+        pthread_t threads[kPrefaultMaxThreads];
+        MemPrefaultSlice slices[kPrefaultMaxThreads];
+        size_t started = 0;
+
+        /* The calling thread takes the first slice and whatever no thread could be started for */
+        for (size_t i = 1; i < count && i * step < length; ++i) {
+            slices[i] = {begin + i * step, min(step, length - i * step)};
+
+            if (pthread_create(&threads[i], nullptr, mem_prefault_thread, &slices[i]) != 0) {
+                break;
+            }
+
+            started = i;
+        }
+
+        size_t rest = (started + 1) * step;
+        mem_prefault_pages(begin, min(step, length));
+
+        if (rest < length) {
+            mem_prefault_pages(begin + rest, length - rest);
+        }
+
+        for (size_t i = 1; i <= started; ++i) {
+            pthread_join(threads[i], nullptr);
+        }
+
+        return;
+    }
+#endif
+    mem_prefault_pages(begin, length);
+}
+
+size_t mem_prefault(size_t bytes)
+{
+    if (gMemStart == nullptr || gMemEnd == nullptr) {
+        return 0;
+    }
+
+    bytes = min(bytes, size_t(mem_block_char_ptr(gMemEnd) - gMemStart));
+    mem_prefault_range(gMemStart, bytes);
+    return bytes;
+}
+
+#if defined(__OSDEV_HAVE_MMAN_H__)
+static void mem_heap_unlock()
+{
+    if (gHeapLocked) {
+        munlock(gHeapLocked, gHeapLockedSize);
+        gHeapLocked = nullptr;
+        gHeapLockedSize = 0;
+    }
+}
+
+static int mem_heap_lock(void *base, size_t size)
+{
+    if (mlock(base, size) != 0) {
+        int error = errno;
+        ALOGE("Could not lock heap %p size %zu, errno %d", base, size, error);
+        return error;
+    }
+
+    gHeapLocked = base;
+    gHeapLockedSize = size;
+    return 0;
+}
+#endif
+
+/* Locks or prefaults a freshly formatted heap as the MEM_INIT flags ask */
+static int mem_heap_settle(void *base, size_t size, unsigned flags)
+{
+    if (flags & MEM_INIT_LOCK) {
+#if defined(__OSDEV_HAVE_MMAN_H__)
+        /* mlock() faults the pages in itself */
+        return mem_heap_lock(base, size);
+#else
+        ALOGE("Could not lock heap %p size %zu: mlock() is not available", base, size);
+        return EINVAL;
+#endif
+    }
+
+    if (flags & MEM_INIT_PREFAULT) {
+        mem_prefault_range(reinterpret_cast<char *>(base), size);
+    }
+
+    return 0;
+}
+
+int mem_initialize(void *base, size_t size, unsigned flags)
+{
+    size_t stateSize = 0;
+#if BINS_ARE_IN_HEAP
+    stateSize = mem_heap_state_size();
+#endif
+
+    if (base && mem_heap_size_is_valid(size, stateSize)) {
+#if defined(__OSDEV_HAVE_MMAN_H__)
+        mem_heap_close();
+        mem_heap_unlock();
+#endif
+        gHeap = stateSize ? reinterpret_cast<MemHeapState *>(base) : &gHeapState;
+        mem_heap_format(base, size, stateSize, flags & MEM_INIT_ZEROED);
+        ALOGD("gHeap %p stateSize %zu gMemStart %p", gHeap, stateSize, gMemStart);
+        int error = mem_heap_settle(base, size, flags);
+
+        if (error) {
+            mem_unuinitialize();
+        }
+
+        return error;
+    }
+    else {
+        ALOGE("Could not initialize memory with params base %p size %zu", base, size);
+    }
+
+    ALOGD("gMemStart %p gMemEnd %p size %td",
+          gMemStart,
+          gMemEnd,
+          mem_block_char_ptr(gMemEnd) - mem_block_char_ptr(gMemStart));
+
+    return EINVAL;
+}
+
+void mem_unuinitialize()
+{
+#if defined(__OSDEV_HAVE_MMAN_H__)
+    mem_heap_unlock();
+#endif
+    gMemStart = nullptr;
+    gMemEnd = nullptr;
+    ++gHeapGeneration;
+}
+
+void mem_heap_set_root(void *ptr)
+{
+    MEM_SHM_SCOPE();
+    gHeap->root = ptr ? mem_block_char_ptr(ptr) - gMemStart : 0;
+}
+
+void *mem_heap_root()
+{
+    MEM_SHM_SCOPE(nullptr);
+    return gMemStart && gHeap->root ? gMemStart + gHeap->root : nullptr;
+}
+
+#if defined(__OSDEV_HAVE_MMAN_H__)
+
+int mem_heap_create(const char *path, size_t size)
+{
+    size_t stateSize = mem_heap_state_size();
+
+    if (!path || !mem_heap_size_is_valid(size, stateSize)) {
+        ALOGE("Could not create heap with params path %s size %zu", path ? path : "(null)", size);
+        return EINVAL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+    if (fd < 0) {
+        ALOGE("Could not open %s", path);
+        return EINVAL;
+    }
+
+    int result = EINVAL;
+
+    if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+        void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (base != MAP_FAILED) {
+            mem_heap_close();
+            gHeapMapping = base;
+            gHeapMappingSize = size;
+            gHeapFileBacked = true;
+            gHeap = reinterpret_cast<MemHeapState *>(base);
+            mem_heap_format(base, size, stateSize, true);
+            result = 0;
+        }
+    }
+
+    close(fd);
+    return result;
+}
+
+static bool mem_heap_state_is_valid(const MemHeapState *state, size_t size)
+{
+    return state->magic == kHeapMagicNumber
+        && state->version == kHeapVersion
+        && state->header_size == kHeaderSize
+        && state->size == size
+        && state->start == mem_heap_state_size() + kHeaderPadding
+        && state->end < size - state->start
+        && state->root < size - state->start;
+}
+
+int mem_heap_open(const char *path)
+{
+    int fd = path ? open(path, O_RDWR) : -1;
+
+    if (fd < 0) {
+        ALOGE("Could not open %s", path ? path : "(null)");
+        return EINVAL;
+    }
+
+    struct stat st{};
+    void *base = MAP_FAILED;
+    size_t size = 0;
+
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) > sizeof(MemHeapState)) {
+        size = static_cast<size_t>(st.st_size);
+        base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        ALOGE("Could not map %s", path);
+        return EINVAL;
+    }
+
+    auto state = reinterpret_cast<MemHeapState *>(base);
+
+    if (mem_heap_state_is_valid(state, size)) {
+        mem_heap_close();
+        gHeapMapping = base;
+        gHeapMappingSize = size;
+        gHeapFileBacked = true;
+        gHeap = state;
+        gBinList = state->bins;
+        gMemStart = mem_block_char_ptr(base) + state->start;
+        gMemEnd = gMemStart + state->end;
+        mem_profile_drop_live();
+        ++gHeapGeneration;
+
+        if (mem_check()) {
+            return 0;
+        }
+
+        ALOGE("Heap image %s is corrupted", path);
+        mem_heap_close();
+        return EINVAL;
+    }
+
+    ALOGE("%s is not a heap image", path);
+    munmap(base, size);
+    return EINVAL;
+}
+
+/**
+ * Shared heap related stuff. The segment is a MemShmHeader padded to a cache
+ * line followed by a regular heap image, whose state and free lists already
+ * use offsets only, so every process can map it at its own address.
+ * Mapped blocks are never used, they would be private to one process.
+ */
+
+#if defined(MEM_HAVE_SHARED_HEAP)
+static constexpr size_t kShmMagicNumber = 0x53484D48454150ULL;
+
+static constexpr size_t kShmHeaderSize = kCacheLineSize * ((sizeof(MemShmHeader) + kCacheLineSize - 1) / kCacheLineSize);
+
+static void mem_heap_shm_attach(void *base, size_t size)
+{
+    mem_heap_close();
+    gHeapMapping = base;
+    gHeapMappingSize = size;
+    gHeapFileBacked = true;
+    gHeapShm = reinterpret_cast<MemShmHeader *>(base);
+    gHeap = reinterpret_cast<MemHeapState *>(mem_block_char_ptr(base) + kShmHeaderSize);
+    gBinList = gHeap->bins;
+}
+
+int mem_heap_shm_create(int fd, size_t size)
+{
+    size_t stateSize = mem_heap_state_size();
+
+    if (fd < 0 || size <= kShmHeaderSize || !mem_heap_size_is_valid(size - kShmHeaderSize, stateSize)) {
+        ALOGE("Could not create shared heap with params fd %d size %zu", fd, size);
+        return EINVAL;
+    }
+
+    /* Dropping the old contents first makes the whole segment zero filled */
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        ALOGE("Could not resize shared heap segment %d", fd);
+        return EINVAL;
+    }
+
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (base == MAP_FAILED) {
+        ALOGE("Could not map shared heap segment %d", fd);
+        return EINVAL;
+    }
+
+    auto shm = reinterpret_cast<MemShmHeader *>(base);
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    int result = pthread_mutex_init(&shm->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if (result != 0) {
+        ALOGE("Could not create shared heap lock, error %d", result);
+        munmap(base, size);
+        return EINVAL;
+    }
+
+    mem_heap_shm_attach(base, size);
+    mem_heap_format(gHeap, size - kShmHeaderSize, stateSize, true);
+    /* Other processes only attach once the magic is there, so it is written last */
+    __atomic_store_n(&shm->magic, kShmMagicNumber, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int mem_heap_shm_open(int fd)
+{
+    struct stat st{};
+
+    if (fd < 0 || fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) <= kShmHeaderSize + sizeof(MemHeapState)) {
+        ALOGE("Could not open shared heap segment %d", fd);
+        return EINVAL;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (base == MAP_FAILED) {
+        ALOGE("Could not map shared heap segment %d", fd);
+        return EINVAL;
+    }
+
+    auto shm = reinterpret_cast<MemShmHeader *>(base);
+    auto state = reinterpret_cast<MemHeapState *>(mem_block_char_ptr(base) + kShmHeaderSize);
+
+    if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != kShmMagicNumber
+        || !mem_heap_state_is_valid(state, size - kShmHeaderSize)) {
+        ALOGE("Segment %d is not a shared heap", fd);
+        munmap(base, size);
+        return EINVAL;
+    }
+
+    mem_heap_shm_attach(base, size);
+    gMemStart = mem_block_char_ptr(state) + state->start;
+    gMemEnd = gMemStart + state->end;
+    mem_profile_drop_live();
+    ++gHeapGeneration;
+
+    if (mem_check()) {
+        return 0;
+    }
+
+    ALOGE("Shared heap in segment %d is corrupted", fd);
+    mem_heap_close();
+    return EINVAL;
+}
+#endif
+
+void mem_heap_close()
+{
+    if (gHeapMapping) {
+        if (gHeapFileBacked) {
+            msync(gHeapMapping, gHeapMappingSize, MS_SYNC);
+        }
+
+        mem_heap_unlock();
+        munmap(gHeapMapping, gHeapMappingSize);
+        gHeapMapping = nullptr;
+        gHeapMappingSize = 0;
+        gHeapFileBacked = false;
+        gHugePageSize = 0;
+#if defined(MEM_HAVE_SHARED_HEAP)
+        gHeapShm = nullptr;
+#endif
+        gHeap = &gHeapState;
+        gBinList = gHeapState.bins;
+        mem_unuinitialize();
+    }
+}
+
+/**
+ * Maps anonymous memory for the heap, preferring explicit huge pages, then
+ * transparent huge pages on a huge page aligned range, then regular pages.
+ */
+static void *mem_heap_map_pages(size_t *size)
+{
+    void *base = MAP_FAILED;
+    size_t length = kHugePageSize * ((*size + kHugePageSize - 1) / kHugePageSize);
+#if defined(MAP_HUGETLB)
+    base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (base != MAP_FAILED) {
+        gHugePageSize = kHugePageSize;
+        *size = length;
+        return base;
+    }
+#endif
+    char *reserved = reinterpret_cast<char *>(mmap(nullptr, length + kHugePageSize, PROT_READ | PROT_WRITE,
+                                                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+    if (reserved == MAP_FAILED) {
+        return nullptr;
+    }
+
+    auto address = reinterpret_cast<uintptr_t>(reserved);
+    char *aligned = reinterpret_cast<char *>((address + kHugePageSize - 1) & ~(kHugePageSize - 1));
+    size_t head = aligned - reserved;
+
+    if (head) {
+        munmap(reserved, head);
+    }
+
+    munmap(aligned + length, kHugePageSize - head);
+    *size = length;
+#if defined(MADV_HUGEPAGE)
+    if (madvise(aligned, length, MADV_HUGEPAGE) == 0) {
+        gHugePageSize = kHugePageSize;
+    }
+#endif
+    return aligned;
+}
+
+int mem_heap_map(size_t size, unsigned flags)
+{
+    if (!mem_heap_size_is_valid(size, 0)) {
+        ALOGE("Could not map heap with size %zu", size);
+        return EINVAL;
+    }
+
+    mem_heap_close();
+    size_t length = size;
+    void *base = mem_heap_map_pages(&length);
+
+    if (!base) {
+        ALOGE("Could not map heap with size %zu", size);
+        return EINVAL;
+    }
+
+    gHeapMapping = base;
+    gHeapMappingSize = length;
+    gHeap = &gHeapState;
+    /* The rounded up mapping may be too large for the offsets of a compact heap */
+    mem_heap_format(base, mem_heap_size_is_valid(length, 0) ? length : size, 0, true);
+    ALOGD("Mapped heap %p size %zu huge page size %zu", base, size, gHugePageSize);
+    /* Not MAP_POPULATE: it faults in one thread, and before MADV_HUGEPAGE on the transparent huge page path */
+    int error = mem_heap_settle(base, length, flags);
+
+    if (error) {
+        mem_heap_close();
+    }
+
+    return error;
+}
+
+#endif /* __OSDEV_HAVE_MMAN_H__ */
+
+size_t mem_heap_huge_page_size()
+{
+    return gHugePageSize;
+}
+
+static void mem_block_info(void *block, size_t bin, MemBlockInfo *info)
+{
+    info->address = block;
+    info->size = mem_block_size(block);
+    info->state = mem_block_is_allocated(block) ? MEM_BLOCK_ALLOCATED : MEM_BLOCK_FREE;
+    info->bin = bin;
+}
+
+size_t mem_heap_walk(mem_walk_callback_t callback, void *ctx)
+{
+    MEM_SHM_SCOPE(0);
+
+    size_t count = 0;
+
+    if (gMemStart == nullptr || gMemEnd == nullptr || callback == nullptr) {
+        return count;
+    }
+
+    MemBlockInfo info;
+    void *end = mem_block_user_ptr(gMemEnd);
+
+    for (void *block = mem_block_next(mem_block_user_ptr(gMemStart)); block != end;
+         block = mem_block_next(block)) {
+        ++count;
+        bool binned = mem_block_is_free(block) && block != mem_victim() && !mem_block_is_top(block);
+        mem_block_info(block, binned ? bin_index_from_size(mem_block_size(block)) : MEM_NO_BIN, &info);
+
+        if (!callback(&info, ctx)) {
+            break;
+        }
+    }
+
+    return count;
+}
+
+size_t mem_bin_walk(mem_walk_callback_t callback, void *ctx)
+{
+    MEM_SHM_SCOPE(0);
+
+    size_t count = 0;
+
+    if (gMemStart == nullptr || callback == nullptr) {
+        return count;
+    }
+
+    MemBlockInfo info;
+
+    for (size_t index = 0; index < kBinCount; ++index) {
+        for (ListHead *head = gBinList[index]; head; head = head->next) {
+            ++count;
+            mem_block_info(head, index, &info);
+
+            if (!callback(&info, ctx)) {
+                return count;
+            }
+        }
+    }
+
+    /* The victim and the top chunk are out of the bins, they come last */
+    void *outside[] = {mem_victim(), mem_top()};
+
+    for (void *block: outside) {
+        if (block) {
+            ++count;
+            mem_block_info(block, MEM_NO_BIN, &info);
+
+            if (!callback(&info, ctx)) {
+                break;
+            }
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Binary snapshot related stuff. Records are gathered into a buffer on the
+ * stack and written out in large chunks, so dumping millions of blocks is a
+ * handful of system calls instead of one log line per block.
+ */
+
+#if defined(__OSDEV_HAVE_UNISTD_H__)
+static constexpr size_t kSnapshotBufferSize = 32 * 1024;
+
+struct MemSnapshotWriter
+{
+    int fd;
+    int error;
+    size_t used;
+    unsigned char buffer[kSnapshotBufferSize];
+};
+
+static void mem_snapshot_flush(MemSnapshotWriter *writer)
+{
+    size_t done = 0;
+
+    while (!writer->error && done < writer->used) {
+        ssize_t n = write(writer->fd, writer->buffer + done, writer->used - done);
+
+        if (n > 0) {
+            done += n;
+        }
+        else if (n == 0 || errno != EINTR) {
+            writer->error = n == 0 ? EIO : errno;
+        }
+    }
+
+    writer->used = 0;
+}
+
+static void mem_snapshot_append(MemSnapshotWriter *writer, const void *data, size_t size)
+{
+    if (writer->used + size > kSnapshotBufferSize) {
+        mem_snapshot_flush(writer);
+    }
+
+    __builtin_memcpy(writer->buffer + writer->used, data, size);
+    writer->used += size;
+}
+
+static bool mem_snapshot_block(const MemBlockInfo *info, void *ctx)
+{
+    auto writer = static_cast<MemSnapshotWriter *>(ctx);
+    MemSnapshotRecord record = {};
+    record.offset = mem_block_char_ptr(info->address) - gMemStart;
+    record.size = info->size;
+    record.state = info->state;
+    record.bin = info->bin == MEM_NO_BIN ? MEM_SNAPSHOT_NO_BIN : uint32_t(info->bin);
+    mem_snapshot_append(writer, &record, sizeof(record));
+    return !writer->error;
+}
+
+int mem_dump_binary(int fd)
+{
+    /* The count in the header must match the records */
+    MEM_SHM_SCOPE(shmScope.error);
+
+    if (gMemStart == nullptr || gMemEnd == nullptr || fd < 0) {
+        return EINVAL;
+    }
+
+    MemSnapshotWriter writer;
+    writer.fd = fd;
+    writer.error = 0;
+    writer.used = 0;
+
+    MemSnapshotHeader header = {};
+    __builtin_memcpy(header.magic, MEM_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = MEM_SNAPSHOT_VERSION;
+    header.record_size = sizeof(MemSnapshotRecord);
+    header.block_overhead = kOverheadSize;
+    header.heap_size = gMemEnd - gMemStart;
+    header.block_count = mem_heap_walk([](const MemBlockInfo *, void *) { return true; }, nullptr);
+    mem_snapshot_append(&writer, &header, sizeof(header));
+
+    mem_heap_walk(mem_snapshot_block, &writer);
+    mem_snapshot_flush(&writer);
+
+    if (writer.error) {
+        ALOGE("Could not write heap snapshot, errno %d", writer.error);
+    }
+
+    return writer.error;
+}
+#endif
+
+void dump_mem()
 {
     void *cur_blk = nullptr;
     size_t total_memory = 0;
@@ -713,7 +3785,8 @@ static size_t dump_list(ListHead *list, size_t index = 0)
         ALOGD("block %p size %zu size with overhead %zu mem bin[%zu] prev addr %p next addr %p",
               block,
               mem_block_size(block),
-              mem_block_size_with_overhead(block), index, ptr->prev, ptr->next);
+              mem_block_size_with_overhead(block), index,
+              static_cast<ListHead *>(ptr->prev), static_cast<ListHead *>(ptr->next));
         ptr = ptr->next;
     }
 
@@ -773,25 +3846,137 @@ bool mem_block_check(void *p)
     return false;
 }
 
+static bool mem_heap_contains(void *p)
+{
+    return p >= mem_block_user_ptr(gMemStart) && p <= mem_block_user_ptr(gMemEnd);
+}
+
+static bool bin_contains(void *block)
+{
+    auto head = reinterpret_cast<ListHead *>(block);
+    ListHead *prev = head->prev;
+    ListHead *next = head->next;
+
+    if (next && (!mem_heap_contains(next) || next->prev != head)) {
+        return false;
+    }
+
+    if (prev) {
+        return mem_heap_contains(prev) && prev->next == head;
+    }
+
+    return gBinList[bin_index_from_size(mem_block_size(block))] == head;
+}
+
+/**
+ * Validates one block: bounds, magic numbers, header against footer and, for
+ * free blocks, bin membership and the absence of a free successor.
+ */
+static bool mem_block_validate(void *block)
+{
+    char *limit = mem_block_char_ptr(gMemEnd) + kHeaderSize + kOverheadSize;
+
+    if (!mem_heap_contains(block) || mem_block_footer(block) > limit) {
+        ALOGE("Bad block (%p). The block is out of the heap", block);
+        return false;
+    }
+
+    if (!mem_block_check(block)
+        || *mem_block_word_ptr(mem_block_footer(block) + kMagicNumberOffset) != kMagicNumber) {
+        ALOGE("Bad block (%p). Footer magic is corrupted", block);
+        return false;
+    }
+
+    if (mem_block_is_free(block)) {
+        if (mem_block_is_free(mem_block_next(block))) {
+            ALOGE("Bad block (%p). Adjacent free blocks are not merged", block);
+            return false;
+        }
+
+        if (block != mem_victim() && !mem_block_is_top(block) && !bin_contains(block)) {
+            ALOGE("Bad block (%p). Free block is not linked into its bin", block);
+            return false;
+        }
+    }
+
+    return true;
+}
+
 bool mem_check(bool verbose)
 {
+    MEM_SHM_SCOPE(false);
+
     char buffer[kMaxMessageLen];
 
     if (gMemStart != nullptr && gMemEnd != nullptr) {
-        for (void *cur_blk = mem_block_user_ptr(gMemStart); cur_blk <= mem_block_user_ptr(gMemEnd);
+        void *end = mem_block_user_ptr(gMemEnd);
+        void *victim = mem_victim();
+        bool victim_found = victim == nullptr;
+
+        for (void *cur_blk = mem_block_user_ptr(gMemStart); cur_blk <= end;
              cur_blk = mem_block_next(cur_blk)) {
+            victim_found |= cur_blk == victim && mem_block_is_free(cur_blk);
+
+            if (!mem_block_validate(cur_blk)) {
+                if (verbose) {
+                    ALOGD("block %p BAD", cur_blk);
+                }
+
+                return false;
+            }
+
             if (verbose) {
                 mem_print_block_to_str(cur_blk, buffer);
+                ALOGD("%s OK", buffer);
+            }
 
-                if (!mem_block_check(cur_blk)) {
-                    ALOGD("block %s BAD", buffer);
-                    return false;
+            if (cur_blk == end) {
+                if (!victim_found) {
+                    ALOGE("Victim %p is not a free block of the heap", victim);
                 }
 
-                ALOGD("%s OK", buffer);
+                return victim_found;
             }
         }
+
+        ALOGE("Heap walk does not end at the end service block");
+        return false;
     }
 
     return true;
-}
\ No newline at end of file
+}
+
+MemCheckStatus mem_check_step(size_t budget_blocks)
+{
+    MEM_SHM_SCOPE(MEM_CHECK_CORRUPTED);
+
+    if (gMemStart == nullptr || gMemEnd == nullptr) {
+        return MEM_CHECK_COMPLETE;
+    }
+
+    void *end = mem_block_user_ptr(gMemEnd);
+    void *block = gHeap->check_cursor ? gMemStart + gHeap->check_cursor : mem_block_user_ptr(gMemStart);
+
+    for (; budget_blocks > 0; --budget_blocks) {
+        if (!mem_block_validate(block)) {
+            gHeap->check_cursor = 0;
+            return MEM_CHECK_CORRUPTED;
+        }
+
+        if (block == end) {
+            gHeap->check_cursor = 0;
+            return MEM_CHECK_COMPLETE;
+        }
+
+        block = mem_block_next(block);
+
+        if (block > end) {
+            ALOGE("Heap walk does not end at the end service block");
+            gHeap->check_cursor = 0;
+            return MEM_CHECK_CORRUPTED;
+        }
+    }
+
+    gHeap->check_cursor = mem_block_char_ptr(block) - gMemStart;
+    return MEM_CHECK_IN_PROGRESS;
+}
@@ -57,16 +57,184 @@
 #   endif /* ifndef min */
 #endif
 
-int mem_initialize(void *base, size_t size);
+typedef size_t mem_handle_t;
+
+/* Bump pointer arena, see mem_arena_create() */
+struct MemArena;
+
+enum MemCheckStatus
+{
+    MEM_CHECK_IN_PROGRESS,
+    MEM_CHECK_COMPLETE,
+    MEM_CHECK_CORRUPTED
+};
+
+enum MemBlockState
+{
+    MEM_BLOCK_FREE,
+    MEM_BLOCK_ALLOCATED
+};
+
+/* Bin index reported for blocks which are not linked into any bin */
+#define MEM_NO_BIN ((size_t) -1)
+
+struct MemBlockInfo
+{
+    void *address;
+    size_t size;
+    MemBlockState state;
+    size_t bin;
+};
+
+/* Return false to stop the walk */
+typedef bool (*mem_walk_callback_t)(const MemBlockInfo *info, void *ctx);
+
+/**
+ * Binary heap snapshot written by mem_dump_binary(): a MemSnapshotHeader and
+ * then one MemSnapshotRecord per block in address order. Offsets are payload
+ * offsets from the heap start, a block spans block_overhead more bytes than
+ * its size. Fields are in host byte order.
+ */
+#define MEM_SNAPSHOT_MAGIC "MEMSNAP"
+
+#define MEM_SNAPSHOT_VERSION 1
+
+/* Bin of a record for a block which is not linked into any bin: allocated, the victim or the top chunk */
+#define MEM_SNAPSHOT_NO_BIN ((uint32_t) -1)
+
+struct MemSnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t block_overhead;
+    uint32_t reserved;
+    uint64_t heap_size;
+    uint64_t block_count;
+};
+
+struct MemSnapshotRecord
+{
+    uint64_t offset;
+    uint64_t size;
+    uint32_t state;
+    uint32_t bin;
+};
+
+/**
+ * Per tag accounting of blocks from mem_malloc_tagged() and friends. Live
+ * bytes count whole blocks, the tag prefix and alignment padding included.
+ * A non zero limit makes tagged allocations fail with ENOMEM once the
+ * requested size would take the tag past it. Targets with 8 byte alignment
+ * have no spare header bit, there tagged allocations are not tracked.
+ */
+#define MEM_TAG_COUNT 64
+
+struct MemTagStats
+{
+    size_t live_bytes;
+    size_t live_count;
+    size_t limit;
+};
+
+/**
+ * Latency histograms, built with MEM_LATENCY_STATS only. Size class c counts
+ * requests of up to 64 << 2c bytes, the last class everything larger.
+ * Bucket b counts operations which took [2^b, 2^(b+1)) ticks, bucket 0 also
+ * those which took none, the last bucket everything longer.
+ */
+#if defined(MEM_LATENCY_STATS)
+enum MemLatencyOp
+{
+    MEM_LATENCY_MALLOC,
+    MEM_LATENCY_FREE,
+    MEM_LATENCY_REALLOC,
+    MEM_LATENCY_MALLOC_ALIGNED,
+    MEM_LATENCY_OP_COUNT
+};
+
+#define MEM_LATENCY_SIZE_CLASSES 8
+
+#define MEM_LATENCY_BUCKETS 32
+
+struct MemLatencyStats
+{
+    /* Rate of the clock the latencies are measured with */
+    uint64_t ticks_per_second;
+    uint64_t counts[MEM_LATENCY_OP_COUNT][MEM_LATENCY_SIZE_CLASSES][MEM_LATENCY_BUCKETS];
+};
+#endif
+
+enum MemInitFlags
+{
+    /* The memory passed to mem_initialize() is already zero filled */
+    MEM_INIT_ZEROED = 1 << 0,
+    /* Fault every page of the heap in up front, with several threads for multi-GB heaps */
+    MEM_INIT_PREFAULT = 1 << 1,
+    /* Lock the heap into RAM with mlock(), which also faults it in */
+    MEM_INIT_LOCK = 1 << 2
+};
+
+int mem_initialize(void *base, size_t size, unsigned flags = 0);
 void mem_unuinitialize();
+size_t mem_prefault(size_t bytes);
 void *mem_malloc(size_t size);
 void *mem_malloc_aligned(size_t size, size_t alignment);
+void *mem_malloc_cacheline(size_t size);
+void *mem_malloc_hint(size_t size, size_t expected_max);
+void mem_set_cacheline_threshold(size_t threshold);
 void *mem_calloc(size_t num, size_t size);
 void *mem_realloc(void *p, size_t new_sz);
+void *mem_realloc_aligned(void *p, size_t new_sz, size_t alignment);
 void mem_free(void *ptr);
+void mem_free_batch(void **ptrs, size_t n);
+mem_handle_t mem_handle_alloc(size_t size);
+void *mem_handle_lock(mem_handle_t handle);
+void mem_handle_unlock(mem_handle_t handle);
+void mem_handle_free(mem_handle_t handle);
+size_t mem_compact();
+MemArena *mem_arena_create(size_t chunk_size);
+void *mem_arena_alloc(MemArena *arena, size_t size, size_t align = 0);
+void mem_arena_reset(MemArena *arena);
+void mem_arena_destroy(MemArena *arena);
+size_t mem_heap_huge_page_size();
+void mem_set_stream_threshold(size_t threshold);
+void mem_heap_set_root(void *ptr);
+void *mem_heap_root();
+void *mem_malloc_tagged(size_t size, unsigned tag);
+void *mem_calloc_tagged(size_t num, size_t size, unsigned tag);
+void *mem_malloc_aligned_tagged(size_t size, size_t alignment, unsigned tag);
+int mem_tag_stats(unsigned tag, MemTagStats *stats);
+int mem_tag_set_limit(unsigned tag, size_t limit);
+#if defined(__OSDEV_HAVE_EXECINFO_H__)
+int mem_profile_start(size_t sample_period);
+void mem_profile_stop();
+int mem_profile_dump(int fd);
+#endif
+#if defined(MEM_LATENCY_STATS)
+void mem_latency_snapshot(MemLatencyStats *stats);
+void mem_latency_reset();
+#endif
+#if defined(__OSDEV_HAVE_MMAN_H__)
+int mem_heap_create(const char *path, size_t size);
+int mem_heap_open(const char *path);
+void mem_set_mmap_threshold(size_t threshold);
+void mem_heap_close();
+int mem_heap_map(size_t size, unsigned flags = 0);
+#if defined(__OSDEV_HAVE_PTHREAD_H__)
+int mem_heap_shm_create(int fd, size_t size);
+int mem_heap_shm_open(int fd);
+#endif
+#endif
+size_t mem_heap_walk(mem_walk_callback_t callback, void *ctx);
+size_t mem_bin_walk(mem_walk_callback_t callback, void *ctx);
+#if defined(__OSDEV_HAVE_UNISTD_H__)
+int mem_dump_binary(int fd);
+#endif
 [[maybe_unused]] void dump_mem();
 [[maybe_unused]] void dump_bins();
 [[maybe_unused]] bool mem_block_check(void *p);
 [[maybe_unused]] bool mem_check(bool verbose = false);
+MemCheckStatus mem_check_step(size_t budget_blocks);
 
 #endif //MEMORY_H
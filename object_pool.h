@@ -0,0 +1,138 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2026 Dmitry Adzhiev <dmitry.adjiev@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+/* <new> and <utility> are freestanding headers, placement new and std::forward come from them */
+#include <new>
+#include <utility>
+#include "memory.h"
+
+/**
+ * Pool of fixed size slots for objects of type T. Chunks of SlotsPerChunk
+ * slots are taken from the heap with mem_malloc_aligned() and never given
+ * back before the pool is destroyed. Free slots form an intrusive list, so
+ * create() and destroy() are a pointer pop and push.
+ *
+ * The destructor releases the chunks without running destructors of objects
+ * which are still alive.
+ */
+template<typename T, size_t SlotsPerChunk = 64>
+class ObjectPool
+{
+    static_assert(SlotsPerChunk > 0, "a chunk needs at least one slot");
+
+    union Slot
+    {
+        Slot *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    struct Chunk
+    {
+        Chunk *next;
+        Slot slots[SlotsPerChunk];
+    };
+
+public:
+    static constexpr size_t kSlotSize = sizeof(Slot);
+
+    static constexpr size_t kSlotAlignment = alignof(Slot);
+
+    ObjectPool() = default;
+
+    ObjectPool(const ObjectPool &) = delete;
+
+    ObjectPool &operator=(const ObjectPool &) = delete;
+
+    ~ObjectPool()
+    {
+        while (mChunks) {
+            Chunk *next = mChunks->next;
+            mem_free(mChunks);
+            mChunks = next;
+        }
+    }
+
+    /* Returns nullptr when the heap is out of memory */
+    template<typename... Args>
+    T *create(Args &&... args)
+    {
+        if (!mFree && !grow()) {
+            return nullptr;
+        }
+
+        Slot *slot = mFree;
+        mFree = slot->next;
+#if defined(__cpp_exceptions)
+        try {
+            return new(slot->storage) T(std::forward<Args>(args)...);
+        }
+        catch (...) {
+            slot->next = mFree;
+            mFree = slot;
+            throw;
+        }
+#else
+        return new(slot->storage) T(std::forward<Args>(args)...);
+#endif
+    }
+
+    void destroy(T *object)
+    {
+        if (object) {
+            object->~T();
+            auto slot = reinterpret_cast<Slot *>(object);
+            slot->next = mFree;
+            mFree = slot;
+        }
+    }
+
+private:
+    bool grow()
+    {
+        auto chunk = static_cast<Chunk *>(mem_malloc_aligned(sizeof(Chunk), alignof(Chunk)));
+
+        if (!chunk) {
+            return false;
+        }
+
+        chunk->next = mChunks;
+        mChunks = chunk;
+
+        for (size_t i = SlotsPerChunk; i > 0; --i) {
+            chunk->slots[i - 1].next = mFree;
+            mFree = &chunk->slots[i - 1];
+        }
+
+        return true;
+    }
+
+    Chunk *mChunks = nullptr;
+
+    Slot *mFree = nullptr;
+};
+
+#endif //OBJECT_POOL_H